@@ -20,6 +20,10 @@ namespace HashTable {
     HashStrategy<T>* strategy;
     std::vector<TableEntry<T>*> table;
     int nOccupied;
+    // number of deleted entries (tombstones) still allocated in the table
+    size_t nDeleted;
+    // entries of removed elements (see clear), recycled by the next inserts
+    std::vector<TableEntry<T>*> spare;
 
     [[nodiscard]] size_t tableSize() const {
       return this->table.size();
@@ -43,13 +47,13 @@ namespace HashTable {
       ++nOccupied;
     }
 
-    void resize(size_t neededSize) {
+    // newSize has to be a power of 2
+    void rehash(size_t newSize) {
       nOccupied = 0;
+      nDeleted = 0;
 
       auto oldTable = std::move(this->table);
-      size_t newSize = oldTable.size() * 2;
-      while (newSize < neededSize) newSize *= 2;
-      this->table = std::vector<TableEntry<T>*>(oldTable.size() * 2, nullptr);
+      this->table = std::vector<TableEntry<T>*>(newSize, nullptr);
 
       for (size_t i = 0; i < oldTable.size(); ++i) {
         auto e = oldTable[i];
@@ -84,6 +88,7 @@ namespace HashTable {
 
     void resizeInplace(size_t neededSize) {
       nOccupied = 0;
+      nDeleted = 0;
 
       size_t oldSize = this->tableSize();
 
@@ -146,7 +151,7 @@ namespace HashTable {
     // this enables quadratic probing and double hashing to work correctly
     explicit HashTable(size_t size = 32, HashStrategy<T>* strategy = new QuadraticHashStrategy<T>()) :
         table(nextPow2(size), nullptr),
-        nOccupied(0) {
+        nOccupied(0), nDeleted(0) {
       this->strategy = strategy;
     }
 
@@ -154,6 +159,7 @@ namespace HashTable {
       for (size_t i = 0; i < this->table.size(); ++i) {
         delete this->table[i];
       }
+      for (auto e: this->spare) delete e;
     }
 
     std::vector<TableEntry<T>*> getTable() const {
@@ -188,6 +194,7 @@ namespace HashTable {
         ++collisions;
         if (entry->isDeleted()) {
           entry->setValue(key, hash);
+          --nDeleted;
           break;
         } else if (entry->getValue() == key) {
           return false;
@@ -197,9 +204,16 @@ namespace HashTable {
         entry = table[index];
       }
 
-      // need to create the container
-      if (entry == nullptr)
-        table[index] = new TableEntry<T>(key, hash);
+      // need to create the container (or recycle one)
+      if (entry == nullptr) {
+        if (this->spare.empty()) {
+          table[index] = new TableEntry<T>(key, hash);
+        } else {
+          table[index] = this->spare.back();
+          table[index]->setValue(key, hash);
+          this->spare.pop_back();
+        }
+      }
 
       // we pass 0 to the resize because we just want to double the current size (only 1 jump)
       if (++nOccupied > HashTable::loadFactor * this->tableSize()) resizeInplace(0);
@@ -233,6 +247,7 @@ namespace HashTable {
       if (entry != nullptr) {
         entry->setDeleted();
         --nOccupied;
+        ++nDeleted;
         return true;
       }
       return false;
@@ -242,6 +257,68 @@ namespace HashTable {
       this->reserveInner(nextPow2(newSize));
     }
 
+    /**
+     * Removes all the elements, but keeps the memory for the next inserts (e.g. a table reused by many similar
+     * operations): the table keeps its size and the entries are recycled. The table is halved if less than
+     * 1/8 of it was used (iterating is O(table size)), so it adapts to the size of the recent uses.
+     */
+    void clear() {
+      for (auto& e: this->table) {
+        if (e == nullptr) continue;
+        this->spare.push_back(e);
+        e = nullptr;
+      }
+      // a new (smaller) table is swapped in, since resizing it wouldn't free the memory
+      if (this->tableSize() > 32 && (size_t) nOccupied < this->tableSize() / 8)
+        this->table = std::vector<TableEntry<T>*>(this->tableSize() / 2, nullptr);
+      // the table can't hold more entries than these
+      while ((float) this->spare.size() > HashTable::loadFactor * (float) this->tableSize() + 1) {
+        delete this->spare.back();
+        this->spare.pop_back();
+      }
+      nOccupied = 0;
+      nDeleted = 0;
+    }
+
+    struct MemoryUsage {
+      // the slots of the table (pointers to the entries)
+      size_t slots = 0;
+      // the entries of the elements in the table
+      size_t entries = 0;
+      // the deleted entries that are still allocated
+      size_t tombstones = 0;
+      // the entries kept by clear for the next inserts
+      size_t spare = 0;
+
+      [[nodiscard]] size_t total() const {
+        return slots + entries + tombstones + spare;
+      }
+    };
+
+    /**
+     * @return The memory (in bytes) used by the table
+     */
+    [[nodiscard]] MemoryUsage memoryUsage() const {
+      MemoryUsage usage;
+      usage.slots = this->table.capacity() * sizeof(TableEntry<T>*);
+      usage.entries = nOccupied * sizeof(TableEntry<T>);
+      usage.tombstones = nDeleted * sizeof(TableEntry<T>);
+      usage.spare = this->spare.size() * sizeof(TableEntry<T>);
+      return usage;
+    }
+
+    /**
+     * Shrinks the table to the smallest size that holds the current elements (without going over the
+     * load factor). The deleted (and spare) entries are freed.
+     */
+    void shrink() {
+      for (auto e: this->spare) delete e;
+      this->spare.clear();
+      size_t newSize = nextPow2((size_t) (nOccupied / HashTable::loadFactor) + 1);
+      if (newSize > this->tableSize()) newSize = this->tableSize();
+      this->rehash(newSize);
+    }
+
     typedef HashTableIterator<TableEntry<T>*> const_iterator;
 
     const_iterator begin() const {
@@ -0,0 +1,224 @@
+#ifndef SLAM_MEMORYPOOL_H
+#define SLAM_MEMORYPOOL_H
+
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#ifdef _OPENMP
+
+#include <omp.h>
+
+#endif
+
+namespace octomap {
+  /**
+   * Slab allocator for objects of a fixed type.
+   * Memory is requested from the system in big slabs and objects are carved from them. Freed objects
+   * are kept in a free list and recycled by later allocations (memory is only given back to the system
+   * when the pool is destroyed).
+   * Each (OpenMP) thread has its own cache (free list + current slab), so threads only contend when
+   * they need a new slab.
+   * @warning Objects still alive when the pool is destroyed are NOT destructed, so T should be
+   * trivially destructible (or the user should destroy them first).
+   */
+  template<class T, size_t SLAB_SIZE = 4096>
+  class MemoryPool {
+  private:
+    union Block {
+      Block* next;
+      alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    /** Per-thread allocation cache. Aligned to avoid false sharing between threads. */
+    struct alignas(64) Cache {
+      Block* freeList = nullptr;
+      Block* slabCurr = nullptr;
+      Block* slabEnd = nullptr;
+      /** Objects created minus objects destroyed by this thread (can be negative). */
+      long live = 0;
+    };
+
+    std::vector<Block*> slabs;
+    size_t allocatedBytes = 0;
+    std::vector<Cache> caches;
+    /** Used by threads without a cache of their own (e.g. thread count changed after construction). */
+    Cache sharedCache;
+    /** Guards the slabs */
+    std::mutex mutex;
+    /** Guards the shared cache (a different mutex, since it's held while the cache is refilled) */
+    std::mutex sharedMutex;
+
+    static unsigned int threadIdx() {
+#ifdef _OPENMP
+      return omp_get_thread_num();
+#else
+      return 0;
+#endif
+    }
+
+    /**
+     * Helper method that gives a new slab to the given cache. Any remainder of the previous slab is lost.
+     * @param cache The cache to refill.
+     * @param n The number of objects that fit in the new slab.
+     */
+    void refill(Cache& cache, size_t n = SLAB_SIZE) {
+      auto slab = static_cast<Block*>(::operator new(sizeof(Block) * n));
+      {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->slabs.push_back(slab);
+        this->allocatedBytes += sizeof(Block) * n;
+      }
+      cache.slabCurr = slab;
+      cache.slabEnd = slab + n;
+    }
+
+    Block* allocBlock(Cache& cache) {
+      if (cache.freeList != nullptr) {
+        Block* b = cache.freeList;
+        cache.freeList = b->next;
+        return b;
+      }
+      if (cache.slabCurr == cache.slabEnd) this->refill(cache);
+      return cache.slabCurr++;
+    }
+
+    static void freeBlock(Cache& cache, Block* b) {
+      b->next = cache.freeList;
+      cache.freeList = b;
+    }
+
+  public:
+    MemoryPool() {
+#ifdef _OPENMP
+      this->caches.resize(omp_get_max_threads());
+#else
+      this->caches.resize(1);
+#endif
+    }
+
+    MemoryPool(const MemoryPool&) = delete;
+
+    MemoryPool& operator=(const MemoryPool&) = delete;
+
+    ~MemoryPool() {
+      this->release();
+    }
+
+    /**
+     * Allocates and constructs a new object in the pool.
+     * @param args The arguments forwarded to the constructor of T.
+     * @return A pointer to the new object.
+     */
+    template<class... Args>
+    T* create(Args&& ... args) {
+      Block* b;
+      unsigned int idx = MemoryPool::threadIdx();
+      if (idx < this->caches.size()) [[likely]] {
+        b = this->allocBlock(this->caches[idx]);
+        ++this->caches[idx].live;
+      } else {
+        std::lock_guard<std::mutex> lock(this->sharedMutex);
+        b = this->allocBlock(this->sharedCache);
+        ++this->sharedCache.live;
+      }
+      return new(b->storage) T(std::forward<Args>(args)...);
+    }
+
+    /**
+     * Destructs the given object and gives its memory back to the pool (for recycling).
+     * @param obj The object to destroy. Must have been created by this pool.
+     */
+    void destroy(T* obj) {
+      if (obj == nullptr) return;
+      obj->~T();
+      Block* b = reinterpret_cast<Block*>(obj);
+      unsigned int idx = MemoryPool::threadIdx();
+      if (idx < this->caches.size()) [[likely]] {
+        MemoryPool::freeBlock(this->caches[idx], b);
+        --this->caches[idx].live;
+      } else {
+        std::lock_guard<std::mutex> lock(this->sharedMutex);
+        MemoryPool::freeBlock(this->sharedCache, b);
+        --this->sharedCache.live;
+      }
+    }
+
+    /**
+     * Makes sure the next @param n objects created by the current thread are carved from the same slab,
+     * in creation order (i.e. they are contiguous in memory). A new slab fits exactly n objects.
+     * @warning Objects recycled from the free list are used first, so this should be used on a pool without
+     * freed objects (e.g. a new pool). Threads without a cache of their own share one, so their objects are only
+     * contiguous if no other such thread creates objects in the meantime.
+     * @param n The number of objects to reserve.
+     */
+    void reserve(size_t n) {
+      unsigned int idx = MemoryPool::threadIdx();
+      if (idx < this->caches.size()) [[likely]] {
+        Cache& cache = this->caches[idx];
+        if ((size_t) (cache.slabEnd - cache.slabCurr) < n) this->refill(cache, n);
+      } else {
+        std::lock_guard<std::mutex> lock(this->sharedMutex);
+        if ((size_t) (this->sharedCache.slabEnd - this->sharedCache.slabCurr) < n) this->refill(this->sharedCache, n);
+      }
+    }
+
+    /**
+     * Swaps the memory (and objects) of this pool with the memory of another pool.
+     * @warning Not thread-safe: no other thread can use the pools during the swap.
+     * @param other The pool to swap with.
+     */
+    void swap(MemoryPool& other) {
+      std::swap(this->slabs, other.slabs);
+      std::swap(this->allocatedBytes, other.allocatedBytes);
+      std::swap(this->caches, other.caches);
+      std::swap(this->sharedCache, other.sharedCache);
+    }
+
+    /**
+     * Gives all the memory of the pool back to the system at once. All objects created by the
+     * pool become invalid.
+     */
+    void release() {
+      static_assert(std::is_trivially_destructible_v<T>, "Pool objects are released without being destructed");
+      for (auto slab: this->slabs) ::operator delete(slab);
+      this->slabs.clear();
+      this->allocatedBytes = 0;
+      for (auto& cache: this->caches) cache = Cache();
+      this->sharedCache = Cache();
+    }
+
+    /**
+     * Calculates the number of bytes requested from the system by this pool.
+     * @return The number of bytes allocated by the pool.
+     */
+    [[nodiscard]] size_t getAllocatedBytes() const {
+      return this->allocatedBytes;
+    }
+
+    /**
+     * Calculates the number of objects of the pool that are alive (created and not destroyed).
+     * @warning Not synchronized with the other threads: only exact when no other thread is using the pool.
+     * @return The number of live objects.
+     */
+    [[nodiscard]] size_t getLiveCount() const {
+      long live = this->sharedCache.live;
+      for (const auto& cache: this->caches) live += cache.live;
+      return (size_t) live;
+    }
+
+    /**
+     * Calculates the number of bytes of the pool used by live objects. The rest of the allocated bytes
+     * are slack (freed objects waiting to be recycled and the unused ends of the slabs).
+     * @return The number of bytes used by live objects.
+     */
+    [[nodiscard]] size_t getUsedBytes() const {
+      return this->getLiveCount() * sizeof(Block);
+    }
+  };
+}
+
+#endif //SLAM_MEMORYPOOL_H
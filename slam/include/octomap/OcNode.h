@@ -5,16 +5,173 @@
 #ifndef SLAM_OCNODE_H
 #define SLAM_OCNODE_H
 
+#include <algorithm>
+#include <array>
+#include <bit>
 #include <bitset>
 #include <cassert>
+#include <cinttypes>
 #include <cmath>
+#include <limits>
 #include <ostream>
+#include <span>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
+#if defined(__AVX__) || defined(__SSE2__)
+
+#include <immintrin.h>
+
+#endif
+
+#include "MemoryPool.h"
 #include "OcNodeKey.h"
+#include "VoxelPayload.h"
+
+namespace octomap {
+  /**
+   * How the siblings are compared to decide if they can be pruned (collapsed into their parent).
+   */
+  enum class PruneMode {
+    /** The siblings need to have strictly the same log-odds (lossless) */
+    EXACT,
+    /** The log-odds of the siblings differ at most by a given tolerance */
+    TOLERANCE,
+    /** The siblings agree on their classification (occupied/free) */
+    CLASSIFICATION
+  };
+
+  /**
+   * Statistics of a tree. They are maintained incrementally as the nodes are created, expanded, pruned,
+   * and updated, so they can be queried in O(1).
+   * The levels skipped by path compressed nodes are counted as nodes.
+   */
+  struct OcTreeStats {
+    size_t nodes = 0;
+    size_t leaves = 0;
+    size_t occupiedLeaves = 0;
+    /** The number of nodes at each depth (counting backwards: 0 is the lowest level, the voxels) */
+    std::vector<size_t> nodesPerDepth;
+    /** The nodes (already counted above) that are skipped by path compressed nodes, so they aren't stored */
+    size_t skippedNodes = 0;
+    std::vector<size_t> skippedPerDepth;
+
+    [[nodiscard]] size_t getFreeLeaves() const {
+      return this->leaves - this->occupiedLeaves;
+    }
+
+    void addNodes(unsigned int depth, size_t cnt = 1) {
+      this->nodes += cnt;
+      this->nodesPerDepth[depth] += cnt;
+    }
+
+    void removeNodes(unsigned int depth, size_t cnt = 1) {
+      this->nodes -= cnt;
+      this->nodesPerDepth[depth] -= cnt;
+    }
+
+    void addSkipped(unsigned int depth) {
+      ++this->skippedNodes;
+      ++this->skippedPerDepth[depth];
+    }
+
+    void removeSkipped(unsigned int depth) {
+      --this->skippedNodes;
+      --this->skippedPerDepth[depth];
+    }
+
+    [[nodiscard]] size_t getStoredNodes() const {
+      return this->nodes - this->skippedNodes;
+    }
+
+    void addLeaves(bool occupied, size_t cnt = 1) {
+      this->leaves += cnt;
+      if (occupied) this->occupiedLeaves += cnt;
+    }
+
+    void removeLeaves(bool occupied, size_t cnt = 1) {
+      this->leaves -= cnt;
+      if (occupied) this->occupiedLeaves -= cnt;
+    }
+
+    /**
+     * Clears the statistics (of a tree with the given depth).
+     * @param depth The max depth of the tree.
+     */
+    void reset(unsigned int depth) {
+      *this = OcTreeStats();
+      this->nodesPerDepth.resize(depth + 1, 0);
+      this->skippedPerDepth.resize(depth + 1, 0);
+    }
+
+    /**
+     * Adds the changes recorded by other statistics (e.g. the ones of a thread, started with reset()).
+     * The counts are unsigned, so removals are recorded as wrapped around values, and cancel out when added.
+     * @param delta The changes to add.
+     */
+    void merge(const OcTreeStats& delta) {
+      this->nodes += delta.nodes;
+      this->leaves += delta.leaves;
+      this->occupiedLeaves += delta.occupiedLeaves;
+      this->skippedNodes += delta.skippedNodes;
+      for (size_t i = 0; i < this->nodesPerDepth.size(); ++i) {
+        this->nodesPerDepth[i] += delta.nodesPerDepth[i];
+        this->skippedPerDepth[i] += delta.skippedPerDepth[i];
+      }
+    }
+  };
+
+  /**
+   * The state shared by all the nodes of a tree. It is owned by the tree (Octomap).
+   * Threads working on disjoint subtrees use their own copy, with their own statistics (merged afterwards).
+   */
+  template<class NODE>
+  struct OcTreeContext {
+    /**
+     * The pool of the children blocks of the tree (the 8 children of a node are allocated together, in a
+     * contiguous block). It is owned by the tree, and it is thread-safe.
+     */
+    MemoryPool<std::array<NODE, 8>>& blocks;
+    PruneMode pruneMode = PruneMode::EXACT;
+    /** The maximum log-odds difference between prunable siblings (only used with PruneMode::TOLERANCE) */
+    float pruneTolerance = 0;
+    /** Whether chains of single-child nodes are collapsed into path compressed nodes */
+    bool pathCompression = false;
+    OcTreeStats stats;
+
+    explicit OcTreeContext(MemoryPool<std::array<NODE, 8>>& blocks) : blocks(blocks) {}
+
+    /**
+     * Checks if the tree can have path compressed nodes (so a descent can find skipped levels). The tree is
+     * decompressed when path compression is disabled (see Octomap::setPathCompression), so only while enabled.
+     * @return True if the tree can have path compressed nodes. False, if every level of the tree is stored.
+     */
+    [[nodiscard]] bool hasSkips() const {
+      return this->pathCompression;
+    }
+  };
+}
+
+// Nodes are packed to 4 bytes so the smaller log-odds representation (int16_t) actually shrinks the
+// node. The (default) float layout is unaffected.
+#pragma pack(push, 4)
 
 namespace octomap {
-  template<class T>
+  /**
+   * A node of the octree.
+   * @tparam T The type of the components of the keys.
+   * @tparam V The type used to store the log-odds: float, or a signed integral type of at least 2 bytes (e.g.
+   * int16_t) for a fixed-point (quantized) representation. A 1 byte type wouldn't shrink the node (it's padded to
+   * 4 bytes), so it's not allowed.
+   * @tparam P The payload stored in the node besides its occupancy (see VoxelPayload.h). The default
+   * payload is empty (no extra memory).
+   */
+  template<class T, typename V = float, class P = OccupancyPayload>
   class OcNode {
+    static_assert(std::is_floating_point_v<V> || (std::is_integral_v<V> && std::is_signed_v<V> && sizeof(V) >= 2),
+                  "The log-odds should be stored as a floating point or signed fixed-point value (of 2+ bytes)");
+
   public:
     /**
      * Converts the given probability (occupancy) to log-odds.
@@ -35,6 +192,11 @@ namespace octomap {
       return 1.0 - (1.0 / (1.0 + exp(logodds)));
     }
 
+    using Payload = P;
+    /** The 8 children of a node are allocated together, in a contiguous block. */
+    using ChildBlock = std::array<OcNode, 8>;
+    using Context = OcTreeContext<OcNode>;
+
   private:
     using Key = OcNodeKey<T>;
 
@@ -42,47 +204,278 @@ namespace octomap {
     inline static double minThreshold = prob2logodds(0.1);
     inline static double maxThreshold = prob2logodds(0.9);
 
-    OcNode** children = nullptr;
-    float logOdds;
+    /**
+     * The fixed-point representation of the log-odds (only used when V is an integral type).
+     * The clamping limits are mapped to the limits of V, so updates saturate on the stable values.
+     */
+    struct FixedPoint {
+      double scale;
+      V min, max, occ;
+
+      FixedPoint() :
+          scale(std::numeric_limits<V>::max() / std::max(-OcNode::minThreshold, OcNode::maxThreshold)),
+          min((V) std::lround(OcNode::minThreshold * scale)),
+          max((V) std::lround(OcNode::maxThreshold * scale)),
+          occ((V) std::lround(OcNode::occThreshold * scale)) {}
+    };
+
+    static const FixedPoint& fixedPoint() {
+      static const FixedPoint fp;
+      return fp;
+    }
+
+    /**
+     * Converts a log-odds value to its stored representation.
+     * Values are assumed to be clamped when stored as floating point.
+     * @param lo The log-odds value to convert.
+     * @return The stored representation of @param lo.
+     */
+    static V encode(float lo) {
+      if constexpr (std::is_floating_point_v<V>) {
+        return lo;
+      } else {
+        lo = std::clamp(lo, (float) OcNode::minThreshold, (float) OcNode::maxThreshold);
+        return (V) std::lround(lo * OcNode::fixedPoint().scale);
+      }
+    }
+
+    /**
+     * Converts a stored log-odds value back to floating point.
+     * @param lo The stored log-odds value.
+     * @return The log-odds value represented by @param lo.
+     */
+    static float decode(V lo) {
+      if constexpr (std::is_floating_point_v<V>) {
+        return lo;
+      } else {
+        return (float) (lo / OcNode::fixedPoint().scale);
+      }
+    }
+
+    /**
+     * The skipped levels of path compressed nodes are stored in the padding left by the other fields:
+     * 1 byte (2 levels) for 2 byte log-odds, and 2 bytes (4 levels) otherwise.
+     */
+    using Skip = std::conditional_t<sizeof(V) == 2, uint8_t, uint16_t>;
+    constexpr static unsigned int MAX_SKIP = sizeof(Skip) == 1 ? 2 : 4;
+    /** The steps of the skipped levels are stored in the lower bits (3 each), and their count in the upper bits */
+    constexpr static unsigned int SKIP_CNT_SHIFT = 3 * MAX_SKIP;
+
+    /** The block holding the 8 children. Only the children flagged in childMask are valid. */
+    ChildBlock* children = nullptr;
+    V logOdds;
+    /** Bit i is set if the child i exists. The children block is allocated iff the mask isn't 0. */
+    uint8_t childMask = 0;
+    /**
+     * Path compression: a node can skip a chain of single-child levels. In that case, this node stands for
+     * the last node of the chain (its log-odds and children are the ones of that node), and the steps of the
+     * skipped levels are stored here. 0 means no levels are skipped.
+     */
+    Skip skip = 0;
+    /** Takes no space with the default (empty) payload */
+    [[no_unique_address]] P payload;
+
+    [[nodiscard]] unsigned int getSkipCount() const {
+      return this->skip >> OcNode::SKIP_CNT_SHIFT;
+    }
+
+    [[nodiscard]] unsigned int getSkipStep(unsigned int i) const {
+      assert(i < this->getSkipCount());
+      return (this->skip >> (3 * i)) & 7;
+    }
+
+    void setSkip(unsigned int cnt, unsigned int steps) {
+      assert(cnt <= OcNode::MAX_SKIP);
+      this->skip = (Skip) ((cnt << OcNode::SKIP_CNT_SHIFT) | steps);
+    }
+
+    /**
+     * Helper method that checks if the given key follows the levels skipped by this node.
+     * @param key The key to check.
+     * @param depth The depth of this node in the tree (counting backwards).
+     * @return True if the key goes through the skipped levels. False, otherwise.
+     */
+    [[nodiscard]] bool followsSkip(const Key& key, unsigned int depth) const {
+      for (unsigned int i = 0; i < this->getSkipCount(); ++i) {
+        if (key.getStep(depth - 1 - i) != this->getSkipStep(i)) return false;
+      }
+      return true;
+    }
+
+    /**
+     * Helper method that makes a new node (without children) skip the levels on the path to the given key.
+     * @param key The key the new node leads to.
+     * @param depth The depth of this node in the tree (counting backwards).
+     * @param ctx The context of the tree.
+     */
+    void compressNew(const Key& key, unsigned int depth, Context& ctx) {
+      assert(this->childMask == 0 && this->skip == 0);
+      unsigned int cnt = std::min(depth, OcNode::MAX_SKIP), steps = 0;
+      for (unsigned int i = 0; i < cnt; ++i) {
+        steps |= key.getStep(depth - 1 - i) << (3 * i);
+        // the skipped levels are nodes of the tree, but the leaf just moves to the last one
+        ctx.stats.addNodes(depth - 1 - i);
+        ctx.stats.addSkipped(depth - 1 - i);
+      }
+      this->setSkip(cnt, steps);
+    }
+
+    /**
+     * Helper method that collapses this node with its only child (if it has a single child and the
+     * skipped levels fit in the node).
+     * @param ctx The context of the tree.
+     * @param depth The depth of this node in the tree (counting backwards).
+     * @return True if the node was collapsed with its child. False, otherwise.
+     */
+    bool compress(Context& ctx, unsigned int depth) {
+      if (std::popcount(this->childMask) != 1) return false;
+      unsigned int pos = std::countr_zero(this->childMask);
+      const OcNode child = (*this->children)[pos];
+      unsigned int cnt = this->getSkipCount() + 1 + child.getSkipCount();
+      if (cnt > OcNode::MAX_SKIP) return false;
+
+      unsigned int steps = (this->skip & ((1 << SKIP_CNT_SHIFT) - 1)) | (pos << (3 * this->getSkipCount()));
+      steps |= (child.skip & ((1 << SKIP_CNT_SHIFT) - 1)) << (3 * (this->getSkipCount() + 1));
+
+      // the child's level becomes a skipped level
+      ctx.stats.addSkipped(depth - 1 - this->getSkipCount());
+      ctx.blocks.destroy(this->children);
+      this->children = child.children;
+      this->childMask = child.childMask;
+      this->logOdds = child.logOdds;
+      this->payload = child.payload;
+      this->setSkip(cnt, steps);
+      return true;
+    }
 
     /**
-     * Helper method that allocates the container for the 8 children of this node.
-     * @warning This doesn't check if the container is already instantiated.
+     * Helper method that collapses the children of this node with their only child (if possible), like fix()
+     * does. Needed when only the updated paths are fixed: undoing the compression of a node on the path (see
+     * decompress()) leaves a child that skips fewer levels, so it can collapse, but isn't on the path.
+     * @param ctx The context of the tree.
+     * @param depth The depth of this node in the tree, below its skipped levels (counting backwards).
      */
-    void allocChildren() {
-      this->children = new OcNode* [8]{nullptr};
+    void compressChildren(Context& ctx, unsigned int depth) {
+      for (int i = 0; i < 8; ++i) {
+        if (this->childExists(i)) (*this->children)[i].compress(ctx, depth - 1);
+      }
     }
 
     /**
-     * Helper method that allocates 8 children for the current node (and their container if needed),
+     * Helper method that undoes the path compression of the first skipped level. The node gets a real
+     * child (that skips the remaining levels).
+     * @param ctx The context of the tree.
+     * @param depth The depth of this node in the tree (counting backwards).
+     */
+    void decompress(Context& ctx, unsigned int depth) {
+      assert(this->getSkipCount() > 0);
+      OcNode child;
+      child.logOdds = this->logOdds;
+      child.payload = this->payload;
+      child.children = this->children;
+      child.childMask = this->childMask;
+      child.setSkip(this->getSkipCount() - 1, (this->skip & ((1 << SKIP_CNT_SHIFT) - 1)) >> 3);
+
+      unsigned int pos = this->getSkipStep(0);
+      this->children = ctx.blocks.create();
+      (*this->children)[pos] = child;
+      this->childMask = (uint8_t) (1 << pos);
+      this->skip = 0;
+      ctx.stats.removeSkipped(depth - 1);
+    }
+
+    /**
+     * Helper method that allocates the block for the 8 children of this node.
+     * @warning This doesn't check if the block is already instantiated.
+     * @param ctx The context of the tree.
+     */
+    void allocChildren(Context& ctx) {
+      this->children = ctx.blocks.create();
+    }
+
+    /**
+     * Helper method that allocates 8 children for the current node (and their block if needed),
      * and initializes them with the log-odds value of the current node (parent).
+     * @param ctx The context of the tree.
+     * @param depth The depth of this node in the tree (counting backwards).
      */
-    void expandNode() {
-      assert(!this->hasChildren());
+    void expandNode(Context& ctx, unsigned int depth) {
+      assert(this->childMask == 0);
       if (this->children == nullptr) {
-        this->allocChildren();
+        this->allocChildren(ctx);
       }
 
+      OcNode child;
+      child.logOdds = this->logOdds;
+      child.payload = this->payload;
+      this->children->fill(child);
+      this->childMask = 0xFF;
+
+      ctx.stats.removeLeaves(this->isOccupied());
+      ctx.stats.addNodes(depth - 1, 8);
+      ctx.stats.addLeaves(this->isOccupied(), 8);
+    }
+
+    /**
+     * Helper method that gives the children of this node (and their successors) back to the pool.
+     * The node becomes a leaf.
+     * @param ctx The context of the tree.
+     * @param depth The depth of this node in the tree (counting backwards).
+     */
+    void deleteChildren(Context& ctx, unsigned int depth) {
+      if (this->children == nullptr) return;
       for (int i = 0; i < 8; ++i) {
-        this->children[i] = new OcNode(this->getLogOdds());
+        if (!this->childExists(i)) continue;
+        OcNode& child = (*this->children)[i];
+        unsigned int childDepth = depth - 1;
+        for (unsigned int j = 0; j <= child.getSkipCount(); ++j) {
+          ctx.stats.removeNodes(childDepth - j);
+          if (j > 0) ctx.stats.removeSkipped(childDepth - j);
+        }
+        // deleting the children of the child makes it a leaf
+        if (child.childMask != 0) child.deleteChildren(ctx, childDepth - child.getSkipCount());
+        ctx.stats.removeLeaves(child.isOccupied());
       }
+
+      ctx.blocks.destroy(this->children);
+      this->children = nullptr;
+      this->childMask = 0;
+      ctx.stats.addLeaves(this->isOccupied());
     }
 
     /**
      * Checks if the current node is "prunable".
-     * A node is "prunable" is it has 8 children with strictly the same occupancy.
+     * A node is "prunable" is it has 8 children (leaves) with the same occupancy. What is considered the
+     * same occupancy depends on the prune mode of the tree: strictly the same log-odds (default), log-odds
+     * within the tolerance, or the same classification.
+     * @param ctx The context of the tree.
      * @return True if the node is prunable. False, otherwise.
      */
-    [[nodiscard]] bool isPrunable() const {
-      OcNode* firstChild = this->getChild(0);
-      if (firstChild == nullptr || firstChild->hasChildren()) return false;
+    [[nodiscard]] bool isPrunable(const Context& ctx) const {
+      // all children exist
+      if (this->childMask != 0xFF) return false;
 
-      for (int i = 1; i < 8; ++i) {
-        OcNode* child = this->getChild(i);
-        if (child == nullptr ||             // all children exist
-            child->hasChildren() ||         // they don't have children of their own
-            (*firstChild) != (*child)) {    // and have the same occupancy
-          return false;
+      const OcNode& firstChild = (*this->children)[0];
+      float minLo = firstChild.getLogOdds(), maxLo = minLo;
+      for (const OcNode& child: *this->children) {
+        // they don't have children of their own
+        if (child.hasChildren()) return false;
+        // their payloads can be merged
+        if (!firstChild.payload.canPrune(child.payload)) return false;
+
+        // and have the same occupancy
+        switch (ctx.pruneMode) {
+          case PruneMode::EXACT:
+            if (firstChild != child) return false;
+            break;
+          case PruneMode::TOLERANCE:
+            minLo = std::min(minLo, child.getLogOdds());
+            maxLo = std::max(maxLo, child.getLogOdds());
+            if (maxLo - minLo > ctx.pruneTolerance) return false;
+            break;
+          case PruneMode::CLASSIFICATION:
+            if (firstChild.isOccupied() != child.isOccupied()) return false;
+            break;
         }
       }
 
@@ -97,9 +490,9 @@ namespace octomap {
     [[nodiscard]] float getMaxChildrenLogOdds() const {
       float max = std::numeric_limits<float>::min();
       for (int i = 0; i < 8; ++i) {
-        OcNode* child = this->children[i];
-        if (child == nullptr) continue;
-        if (child->getLogOdds() > max) max = child->getLogOdds();
+        if (!this->childExists(i)) continue;
+        float lo = (*this->children)[i].getLogOdds();
+        if (lo > max) max = lo;
       }
       return max;
     }
@@ -110,78 +503,365 @@ namespace octomap {
      * @return The mean log-odds value of the node's children.
      */
     [[nodiscard]] float getMeanChildrenLogOdds() const {
-      unsigned int cnt = 0;
       float ret = 0;
       for (int i = 0; i < 8; ++i) {
-        OcNode* child = this->children[i];
-        if (child == nullptr) continue;
-        ret += child->getLogOdds();
-        ++cnt;
+        if (this->childExists(i)) ret += (*this->children)[i].getLogOdds();
+      }
+      return ret / (float) std::popcount(this->childMask);
+    }
+
+    /**
+     * Helper method that sets the node's payload from the payloads of its children (as defined by the payload).
+     */
+    void aggregateChildrenPayload() {
+      if constexpr (!std::is_empty_v<P>) {
+        bool first = true;
+        for (int i = 0; i < 8; ++i) {
+          if (!this->childExists(i)) continue;
+          this->payload.aggregate((*this->children)[i].payload, first);
+          first = false;
+        }
       }
-      return ret / (float) cnt;
     }
 
     /**
      * Helper method that updates the node's log-odds using the maximum log-odds of its children.
      * The mean strategy could be used alternatively (max is the conservative approach).
+     * The payload is aggregated from the payloads of the children.
      */
     void updateBasedOnChildren() {
-      if (this->children == nullptr) return;
+      if (this->childMask == 0) return;
       this->setLogOdds(this->getMaxChildrenLogOdds());
+      this->aggregateChildrenPayload();
+    }
+
+  public:
+    /**
+     * The nodes on the path of a descent, with their depth (below their skipped levels). The next descent to a
+     * nearby key can continue from it, instead of starting at the root (see resume).
+     */
+    struct Path {
+      std::array<std::pair<OcNode*, unsigned int>, Key::size + 1> nodes;
+      unsigned int len = 0;
+
+      /**
+       * Removes the nodes whose subtree doesn't contain the given key (the deepest ones), so the descent to that
+       * key can continue from the last node of the path.
+       * @param from A key in the subtree of the last node of the path (e.g. the key of the last descent).
+       * @param to The key of the next descent.
+       */
+      void resume(const Key& from, const Key& to) {
+        // the levels above the highest different step are shared by both keys
+        auto diff = (from.get(0) ^ to.get(0)) | (from.get(1) ^ to.get(1)) | (from.get(2) ^ to.get(2));
+        auto diffLevels = (unsigned int) std::bit_width((unsigned long) diff);
+        while (this->len > 0 && this->nodes[this->len - 1].second < diffLevels) --this->len;
+      }
+    };
+
+  private:
+
+    /**
+     * The leaves reached by a batch of updates, waiting for their log-odds to be updated together (see
+     * addLogOdds). Applied when full, and at the end of the batch.
+     */
+    struct LeafUpdates {
+      constexpr static size_t CAPACITY = 64;
+      std::array<OcNode*, CAPACITY> leaves;
+      std::array<float, CAPACITY> deltas;
+      size_t size = 0;
+
+      void add(OcNode* leaf, float delta, OcTreeStats& stats) {
+        this->leaves[this->size] = leaf;
+        this->deltas[this->size] = delta;
+        if (++this->size == CAPACITY) this->flush(stats);
+      }
+
+      void flush(OcTreeStats& stats) {
+        OcNode::addLogOdds(std::span(this->leaves.data(), this->size), std::span(this->deltas.data(), this->size),
+                           stats);
+        this->size = 0;
+      }
+    };
+
+    /**
+     * Helper method that adds log-odds values to leaves, with the same saturation as updateLogOdds. With
+     * floating point storage, the additions and clamps of several leaves are done at once (SIMD, with AVX or SSE
+     * when available). Keeps the statistics of the occupied leaves.
+     * @warning The leaves must be distinct.
+     * @param leaves The leaves to update.
+     * @param deltas The log-odds value to add to each leaf.
+     * @param stats The statistics of the tree.
+     */
+    static void addLogOdds(std::span<OcNode* const> leaves, std::span<const float> deltas, OcTreeStats& stats) {
+      assert(leaves.size() == deltas.size());
+      size_t i = 0, becameOccupied = 0, becameFree = 0;
+      if constexpr (std::is_same_v<V, float>) {
+#if defined(__AVX__)
+        const __m256 min = _mm256_set1_ps((float) OcNode::minThreshold);
+        const __m256 max = _mm256_set1_ps((float) OcNode::maxThreshold);
+        const __m256 occ = _mm256_set1_ps((float) OcNode::occThreshold);
+        alignas(32) float lo[8];
+        for (; i + 8 <= leaves.size(); i += 8) {
+          for (int j = 0; j < 8; ++j) lo[j] = leaves[i + j]->logOdds;
+          __m256 prev = _mm256_load_ps(lo);
+          __m256 next = _mm256_min_ps(_mm256_max_ps(_mm256_add_ps(prev, _mm256_loadu_ps(&deltas[i])), min), max);
+          auto wasOcc = (unsigned int) _mm256_movemask_ps(_mm256_cmp_ps(prev, occ, _CMP_GE_OQ));
+          auto isOcc = (unsigned int) _mm256_movemask_ps(_mm256_cmp_ps(next, occ, _CMP_GE_OQ));
+          becameOccupied += std::popcount(isOcc & ~wasOcc);
+          becameFree += std::popcount(wasOcc & ~isOcc);
+          _mm256_store_ps(lo, next);
+          for (int j = 0; j < 8; ++j) leaves[i + j]->logOdds = lo[j];
+        }
+#elif defined(__SSE2__)
+        const __m128 min = _mm_set1_ps((float) OcNode::minThreshold);
+        const __m128 max = _mm_set1_ps((float) OcNode::maxThreshold);
+        const __m128 occ = _mm_set1_ps((float) OcNode::occThreshold);
+        alignas(16) float lo[4];
+        for (; i + 4 <= leaves.size(); i += 4) {
+          for (int j = 0; j < 4; ++j) lo[j] = leaves[i + j]->logOdds;
+          __m128 prev = _mm_load_ps(lo);
+          __m128 next = _mm_min_ps(_mm_max_ps(_mm_add_ps(prev, _mm_loadu_ps(&deltas[i])), min), max);
+          auto wasOcc = (unsigned int) _mm_movemask_ps(_mm_cmpge_ps(prev, occ));
+          auto isOcc = (unsigned int) _mm_movemask_ps(_mm_cmpge_ps(next, occ));
+          becameOccupied += std::popcount(isOcc & ~wasOcc);
+          becameFree += std::popcount(wasOcc & ~isOcc);
+          _mm_store_ps(lo, next);
+          for (int j = 0; j < 4; ++j) leaves[i + j]->logOdds = lo[j];
+        }
+#endif
+      }
+
+      // the remaining leaves (and the fixed-point ones)
+      for (; i < leaves.size(); ++i) {
+        bool wasOccupied = leaves[i]->isOccupied();
+        leaves[i]->updateLogOdds(deltas[i]);
+        if (leaves[i]->isOccupied() != wasOccupied) ++(wasOccupied ? becameFree : becameOccupied);
+      }
+
+      stats.removeLeaves(false, becameOccupied);
+      stats.addLeaves(true, becameOccupied);
+      stats.removeLeaves(true, becameFree);
+      stats.addLeaves(false, becameFree);
     }
 
     /**
-     * Sets/updates the log-odds value of the current node. If the current node isn't at the lowest level
-     * (leaf node), the update function of a child is called (recursive).
+     * Helper method that handles the path compression of a node reached by a descent: new nodes skip the
+     * levels that would only have 1 child, and existing nodes follow (or undo) their skipped levels.
+     * @param key The key representing the target node.
+     * @param depth The depth of this node in the tree (counting backwards).
+     * @param justCreated Whether this node was created because of this update.
+     * @param ctx The context of the tree.
+     * @return The depth below the skipped levels of this node.
+     */
+    unsigned int enter(const Key& key, unsigned int depth, bool justCreated, Context& ctx) {
+      if (justCreated && depth > 0 && ctx.pathCompression) {
+        // skip the levels that would only have 1 child
+        this->compressNew(key, depth, ctx);
+      }
+      if (this->skip != 0) {
+        if (this->followsSkip(key, depth)) {
+          // this node stands for the last node of the skipped levels
+          depth -= this->getSkipCount();
+        } else {
+          // the key leaves the skipped path: the skipped levels are needed again
+          this->decompress(ctx, depth);
+        }
+      }
+      return depth;
+    }
+
+    /**
+     * Helper method that continues a descent from the last node of the given path down to the node represented
+     * by the given key, and sets/updates it. The nodes on the way are added to the path. The ancestors of the
+     * updated node are not updated (lazy).
+     * Updates that wouldn't change the node they reach (an existing leaf, or pruned node) are detected on the
+     * way down, so they don't modify the tree (e.g. expand the pruned node) and don't need a previous search.
      * @param key The key representing the target node.
-     * @param depth The current depth on the tree (counts backwards => 0 is the lowest level).
      * @param lo The log-odds value to use.
      * @param isUpdate Whether this is an update (true) or a set (false).
-     * @param lazy Whether to do a lazy update (default=false).
-     * @param justCreated Whether this node was created because of this update (default=false).
-     * @return A pointer to the (final) updated node.
+     * @param ctx The context of the tree.
+     * @param justCreated Whether the last node of the path was created because of this update.
+     * @param sample The payload of the measurement, integrated into the updated leaf (nullptr for none).
+     * @param path The path of the descent. The key has to go through its last node.
+     * @param pending If not nullptr, the update of the log-odds of the reached leaf is added to it (applied later),
+     * instead of being applied right away. Only for updates.
+     * @param level The depth of the target node (counting backwards). Above the voxels (0), every voxel in the
+     * volume of the target node is updated (see updateSubtree). Only for updates, without path compressed nodes.
+     * @return True if the node was set/updated. False, if the update was skipped (the last node of the path
+     * is the node it reached).
      */
-    OcNode*
-    setOrUpdateLogOdds(const Key& key, unsigned int depth, float lo, bool isUpdate, bool lazy = false,
-                       bool justCreated = false) {
-      bool createdChild = false;
-      OcNode* child;
+    static bool descend(const Key& key, float lo, bool isUpdate, Context& ctx, bool justCreated, const P* sample,
+                        Path& path, LeafUpdates* pending = nullptr, unsigned int level = 0) {
+      assert(level == 0 || (isUpdate && !ctx.hasSkips()));
+      auto [node, depth] = path.nodes[path.len - 1];
 
-      // follow down to last level
-      if (depth > 0) {
+      // follow down to the target level
+      while (depth > level) {
         unsigned int d = depth - 1;
         unsigned int pos = key.getStep(d);
-        if (!this->childExists(pos)) {
+        bool createdChild = false;
+        if (!node->childExists(pos)) {
           // child does not exist, but maybe it's a pruned node?
-          if (!this->hasChildren() && !justCreated) {
+          if (node->childMask == 0 && !justCreated) {
             // current node does not have children AND it is not a new node
-            // -> expand pruned node
-            this->expandNode();
+            // -> expand pruned node (unless the update wouldn't change it)
+            if (node->isNoopUpdate(lo, isUpdate, sample)) return false;
+            node->expandNode(ctx, depth);
           } else {
             // not a pruned node, create requested child
-            this->createChild(pos);
+            node->createChild(pos, ctx, depth);
             createdChild = true;
           }
         }
 
-        child = this->getChild(pos);
-        child->setOrUpdateLogOdds(key, d, lo, isUpdate, lazy, createdChild);
+        node = &(*node->children)[pos];
+        justCreated = createdChild;
+        depth = node->enter(key, d, justCreated, ctx);
+        path.nodes[path.len++] = {node, depth};
+      }
+
+      // an inner node at the target level: update its whole volume
+      if (node->childMask != 0) {
+        node->updateSubtree(lo, sample, ctx, depth);
+        return true;
+      }
+
+      // at last level, update node
+      if (!justCreated && node->isNoopUpdate(lo, isUpdate, sample)) return false;
+      if constexpr (!std::is_empty_v<P>) {
+        if (sample != nullptr) node->payload.integrate(*sample);
+      }
+      if (pending != nullptr) {
+        assert(isUpdate);
+        pending->add(node, lo, ctx.stats);
+        return true;
+      }
+      node->setOrUpdateLeaf(lo, isUpdate, ctx.stats);
+      return true;
+    }
+
+    /**
+     * Sets/updates the log-odds value of the node represented by the given key (in the subtree of the current
+     * node). The descent is iterative: the nodes on the path are recorded, so the non-lazy prunes and parent
+     * updates (and compressions) run bottom-up over that path afterwards, leaving it as fix() would.
+     * @param key The key representing the target node.
+     * @param depth The current depth on the tree (counts backwards => 0 is the lowest level).
+     * @param lo The log-odds value to use.
+     * @param isUpdate Whether this is an update (true) or a set (false).
+     * @param ctx The context of the tree.
+     * @param lazy Whether to do a lazy update.
+     * @param justCreated Whether this node was created because of this update.
+     * @param sample The payload of the measurement, integrated into the updated leaf (nullptr for none).
+     * @param path The path of a previous descent from this node, to continue from (see Path::resume), or an empty
+     * path. It is left leading to the key, without the nodes changed by the non-lazy prunes (or empty).
+     * @return A pointer to the child of this node on the updated path (or this node, if it is the updated leaf,
+     * or it pruned its children or was collapsed with them). If the update was skipped, the node it reached.
+     */
+    OcNode*
+    setOrUpdateLogOdds(const Key& key, unsigned int depth, float lo, bool isUpdate, Context& ctx,
+                       bool lazy, bool justCreated, const P* sample, Path& path) {
+      bool created = false;
+      if (path.len == 0) {
+        path.nodes[0] = {this, this->enter(key, depth, justCreated, ctx)};
+        path.len = 1;
+        created = justCreated;
+      }
+      if (!OcNode::descend(key, lo, isUpdate, ctx, created, sample, path)) return path.nodes[path.len - 1].first;
+      if (path.len == 1) return this;
+      OcNode* child = path.nodes[1].first;
 
-        if (!lazy) {
+      if (!lazy) {
+        // the (path compressed) nodes can change anywhere on the path
+        unsigned int valid = ctx.pathCompression ? 0 : path.len;
+        for (int i = (int) path.len - 2; i >= 0; --i) {
+          auto [parent, parentDepth] = path.nodes[i];
+          if (ctx.pathCompression) parent->compressChildren(ctx, parentDepth);
           // prune if possible (return self if pruned)
-          if (this->prune()) return this;
+          if (parent->prune(ctx, parentDepth)) {
+            // the nodes below are gone
+            valid = std::min(valid, (unsigned int) i + 1);
+            if (i == 0) {
+              path.len = valid;
+              return this;
+            }
+            continue;
+          }
           // updated occupancy if not pruned (still has children)
-          this->updateBasedOnChildren();
+          parent->updateBasedOnChildren();
+          // and collapse it with its only child, like fix() (the child's node is gone)
+          if (ctx.pathCompression && parent->compress(ctx, parentDepth + parent->getSkipCount()) && i == 0) {
+            path.len = valid;
+            return this;
+          }
         }
+        path.len = valid;
+      }
 
-        return child;
-      } else { // at last level, update node, end of recursion
-        if (isUpdate) this->updateLogOdds(lo);
-        else this->setLogOdds(lo);
-        return this;
+      return child;
+    }
+
+    OcNode*
+    setOrUpdateLogOdds(const Key& key, unsigned int depth, float lo, bool isUpdate, Context& ctx,
+                       bool lazy, bool justCreated, const P* sample) {
+      Path path;
+      return this->setOrUpdateLogOdds(key, depth, lo, isUpdate, ctx, lazy, justCreated, sample, path);
+    }
+
+    /**
+     * Helper method that checks if an update reaching this (existing) node can be skipped: the node is stable
+     * (or the update is neutral), and there's no payload to integrate.
+     * @param lo The log-odds value of the update.
+     * @param isUpdate Whether this is an update (true) or a set (false). Sets are never skipped.
+     * @param sample The payload of the update.
+     * @return True if the update wouldn't change the node. False, otherwise.
+     */
+    [[nodiscard]] bool isNoopUpdate(float lo, bool isUpdate, const P* sample) const {
+      return isUpdate && sample == nullptr && !this->wouldChange(lo);
+    }
+
+    /**
+     * Helper method that sets/updates the log-odds of this leaf, and keeps the statistics of the occupied leaves.
+     * @param lo The log-odds value to use.
+     * @param isUpdate Whether this is an update (true) or a set (false).
+     * @param stats The statistics of the tree.
+     */
+    void setOrUpdateLeaf(float lo, bool isUpdate, OcTreeStats& stats) {
+      bool wasOccupied = this->isOccupied();
+      if (isUpdate) this->updateLogOdds(lo);
+      else this->setLogOdds(lo);
+      if (this->isOccupied() != wasOccupied) {
+        stats.removeLeaves(wasOccupied);
+        stats.addLeaves(!wasOccupied);
       }
     }
 
+    /**
+     * Helper method that updates every voxel in the volume of this (inner) node with the same measurement:
+     * the missing children are created, and the leaves of the subtree are updated (see updateLogOddsBatch). The
+     * subtree is fixed on the way back up, like fix().
+     * @warning The tree can't have path compressed nodes (see OcTreeContext::hasSkips).
+     * @param lo The log-odds value to use in the update.
+     * @param sample The payload of the measurement, integrated into the updated leaves (nullptr for none).
+     * @param ctx The context of the tree.
+     * @param depth The depth of this node in the tree (counting backwards).
+     */
+    void updateSubtree(float lo, const P* sample, Context& ctx, unsigned int depth) {
+      assert(!ctx.hasSkips() && this->childMask != 0);
+      for (int i = 0; i < 8; ++i) {
+        bool created = !this->childExists(i);
+        OcNode* child = this->createChild(i, ctx, depth);
+        if (child->childMask != 0) {
+          child->updateSubtree(lo, sample, ctx, depth - 1);
+        } else if (created || !child->isNoopUpdate(lo, true, sample)) {
+          if constexpr (!std::is_empty_v<P>) {
+            if (sample != nullptr) child->payload.integrate(*sample);
+          }
+          child->setOrUpdateLeaf(lo, true, ctx.stats);
+        }
+      }
+      this->fixNode(ctx, depth);
+    }
+
     /**
      * Helper method to convert the current node to a binary format compatible with octoviz.
      * @param baseI What children to start with.
@@ -218,69 +898,86 @@ namespace octomap {
     }
 
   public:
-    explicit OcNode(float logOdds) : logOdds(logOdds) {}
+    explicit OcNode(float logOdds) : logOdds(OcNode::encode(logOdds)) {}
 
     OcNode() : OcNode(OcNode::occThreshold) {}
 
-    ~OcNode() {
-      if (this->children != nullptr) {
-        for (int i = 0; i < 8; ++i) {
-          delete this->children[i];
-        }
-      }
-      delete[] this->children;
-    }
-
     /**
      * Counts the number of children of this node (direct and indirect).
      * @return The number of successors of this node.
      */
     [[nodiscard]] unsigned int getChildCount() const {
-      if (this->children == nullptr) return 0;
-      unsigned int ret = 0;
+      // the skipped levels (path compression) count as 1 node each
+      unsigned int ret = this->getSkipCount() + std::popcount(this->childMask);
       for (int i = 0; i < 8; ++i) {
-        OcNode* child = this->children[i];
-        if (child != nullptr) ret += child->getChildCount() + 1;
+        if (this->childExists(i)) ret += (*this->children)[i].getChildCount();
       }
       return ret;
     }
 
     /**
      * Gets a pointer to a given child (if it exists).
-     * @param pos The index of the child in the children container (pos < 8).
+     * @param pos The index of the child in the children block (pos < 8).
      * @return A pointer to the wanted children. nullptr if it doesn't exist/isn't instantiated.
      */
     [[nodiscard]] OcNode* getChild(unsigned int pos) const {
       assert(pos < 8);
-      if (this->children == nullptr) return nullptr;
-      return this->children[pos];
+      if (!this->childExists(pos)) return nullptr;
+      return &(*this->children)[pos];
     }
 
     /**
      * Creates a child with the given index @param pos.
-     * @param pos The index of the child in the children container (pos < 8).
+     * @param pos The index of the child in the children block (pos < 8).
+     * @param ctx The context of the tree.
+     * @param depth The depth of this node in the tree (counting backwards).
      * @return A pointer to the new child.
      */
-    OcNode* createChild(unsigned int pos) {
+    OcNode* createChild(unsigned int pos, Context& ctx, unsigned int depth) {
       assert(pos < 8);
       if (this->children == nullptr) {
-        this->allocChildren();
+        this->allocChildren(ctx);
+        // we were a leaf
+        ctx.stats.removeLeaves(this->isOccupied());
+      }
+
+      if (!this->childExists(pos)) {
+        (*this->children)[pos] = OcNode();
+        this->childMask |= (uint8_t) (1 << pos);
+        ctx.stats.addNodes(depth - 1);
+        ctx.stats.addLeaves((*this->children)[pos].isOccupied());
       }
+      return &(*this->children)[pos];
+    }
 
-      if (!this->childExists(pos)) this->children[pos] = new OcNode();
-      return this->children[pos];
+    /**
+     * Copies the children blocks of this node's subtree to the given pool, in depth-first order.
+     * The old blocks aren't freed: they are expected to be released all at once by their pool.
+     * @param dst The pool to move the children blocks to.
+     */
+    void relocate(MemoryPool<ChildBlock>& dst) {
+      if (this->childMask == 0) return;
+      this->children = dst.create(*this->children);
+      for (int i = 0; i < 8; ++i) {
+        if (this->childExists(i)) (*this->children)[i].relocate(dst);
+      }
     }
 
     /**
      * Checks if the current node has any children (at least 1).
+     * A path compressed node always has children (the skipped levels).
      * @return True, if the node has at least 1 child. False, otherwise.
      */
     [[nodiscard]] bool hasChildren() const {
-      if (this->children == nullptr) return false;
-      for (int i = 0; i < 8; ++i) {
-        if (this->children[i] != nullptr) return true;
-      }
-      return false;
+      return (this->childMask | this->skip) != 0;
+    }
+
+    /**
+     * Checks if the current node is path compressed (skips a chain of single-child levels).
+     * @return True, if the node skips levels. False, otherwise.
+     */
+    [[nodiscard]] bool skipsLevels() const {
+      return this->skip != 0;
     }
 
     /**
@@ -289,38 +986,53 @@ namespace octomap {
      * @return True, if the child exists. False, otherwise.
      */
     [[nodiscard]] bool childExists(unsigned int pos) const {
-      if (this->children == nullptr) return false;
-      return this->children[pos] != nullptr;
+      assert(pos < 8);
+      return (this->childMask >> pos) & 1;
     }
 
     /**
      * Prunes the node (if possible). The isPrunable method is used to check if
-     * the node is "prunable" beforehand.
+     * the node is "prunable" beforehand. The pruned children are given back to the pool.
+     * @param ctx The context of the tree.
+     * @param depth The depth of this node in the tree (counting backwards).
      * @return True, if the node pruned children. False, otherwise.
      */
-    bool prune() {
-      if (!this->isPrunable()) return false;
+    bool prune(Context& ctx, unsigned int depth) {
+      if (!this->isPrunable(ctx)) return false;
 
-      // all children are equal so we take their value
-      this->setLogOdds(this->getChild(0)->getLogOdds());
-      // delete children
-      for (int i = 0; i < 8; ++i) {
-        delete this->children[i];
-        this->children[i] = nullptr;
+      if (ctx.pruneMode == PruneMode::EXACT) {
+        // all children are equal so we take their value
+        this->logOdds = (*this->children)[0].logOdds;
+      } else {
+        // the children are similar, so the mean is representative of all of them
+        this->setLogOdds(this->getMeanChildrenLogOdds());
       }
-
-      delete[] this->children;
-      this->children = nullptr;
+      this->aggregateChildrenPayload();
+      // delete children
+      this->deleteChildren(ctx, depth);
 
       return true;
     }
 
     [[nodiscard]] float getLogOdds() const {
-      return this->logOdds;
+      return OcNode::decode(this->logOdds);
+    }
+
+    /**
+     * Gets the payload of the node. For inner nodes, it is aggregated from the payloads of the children.
+     * @warning Changing the payload of a node directly isn't propagated to its parents (until the tree is fixed).
+     * @return The payload of the node.
+     */
+    [[nodiscard]] P& getPayload() {
+      return this->payload;
+    }
+
+    [[nodiscard]] const P& getPayload() const {
+      return this->payload;
     }
 
     [[nodiscard]] float getOccupancy() const {
-      return (float) logodds2prob(this->logOdds);
+      return (float) logodds2prob(this->getLogOdds());
     }
 
     /**
@@ -328,23 +1040,42 @@ namespace octomap {
      * @param lo The log-odds value to set.
      */
     void setLogOdds(float lo) {
-      this->logOdds = std::clamp(lo, (float) OcNode::minThreshold, (float) OcNode::maxThreshold);
+      this->logOdds = OcNode::encode(std::clamp(lo, (float) OcNode::minThreshold, (float) OcNode::maxThreshold));
     }
 
     void setOccupancy(float occ) {
       this->setLogOdds((float) prob2logodds(occ));
     }
 
+    /**
+     * Adds the given value to the log-odds of the node. Performs min/max clamping.
+     * With fixed-point storage, this is a saturating integer addition.
+     * @param newLogOdds The log-odds value to add.
+     */
     void updateLogOdds(float newLogOdds) {
-      this->setLogOdds(this->logOdds + newLogOdds);
+      if constexpr (std::is_floating_point_v<V>) {
+        this->setLogOdds(this->logOdds + newLogOdds);
+      } else {
+        const FixedPoint& fp = OcNode::fixedPoint();
+        // bigger changes saturate anyway (this also takes care of infinite values)
+        float maxDelta = (float) (OcNode::maxThreshold - OcNode::minThreshold);
+        int delta = (int) std::lround(std::clamp(newLogOdds, -maxDelta, maxDelta) * fp.scale);
+        this->logOdds = (V) std::clamp((int) this->logOdds + delta, (int) fp.min, (int) fp.max);
+      }
     }
 
     [[nodiscard]] bool isOccupied() const {
-      return this->logOdds >= (float) OcNode::occThreshold;
+      if constexpr (std::is_floating_point_v<V>)
+        return this->logOdds >= (float) OcNode::occThreshold;
+      else
+        return this->logOdds >= OcNode::fixedPoint().occ;
     }
 
     [[nodiscard]] bool isOccupiedStable() const {
-      return this->logOdds == (float) OcNode::maxThreshold;
+      if constexpr (std::is_floating_point_v<V>)
+        return this->logOdds == (float) OcNode::maxThreshold;
+      else
+        return this->logOdds == OcNode::fixedPoint().max;
     }
 
     [[nodiscard]] bool isFree() const {
@@ -352,7 +1083,10 @@ namespace octomap {
     }
 
     [[nodiscard]] bool isFreeStable() const {
-      return this->logOdds == (float) OcNode::minThreshold;
+      if constexpr (std::is_floating_point_v<V>)
+        return this->logOdds == (float) OcNode::minThreshold;
+      else
+        return this->logOdds == OcNode::fixedPoint().min;
     }
 
     /**
@@ -372,37 +1106,343 @@ namespace octomap {
       return true;
     }
 
-    OcNode* setLogOdds(const Key& key, unsigned int depth, float lo, bool lazy = false, bool justCreated = false) {
-      return this->setOrUpdateLogOdds(key, depth, lo, false, lazy, justCreated);
+    OcNode* setLogOdds(const Key& key, unsigned int depth, float lo, Context& ctx, bool lazy = false,
+                       bool justCreated = false, const P* sample = nullptr) {
+      return this->setOrUpdateLogOdds(key, depth, lo, false, ctx, lazy, justCreated, sample);
     }
 
-    OcNode* updateLogOdds(const Key& key, unsigned int depth, float lo, bool lazy = false, bool justCreated = false) {
-      return this->setOrUpdateLogOdds(key, depth, lo, true, lazy, justCreated);
+    OcNode* updateLogOdds(const Key& key, unsigned int depth, float lo, Context& ctx, bool lazy = false,
+                          bool justCreated = false, const P* sample = nullptr) {
+      return this->setOrUpdateLogOdds(key, depth, lo, true, ctx, lazy, justCreated, sample);
     }
 
-    OcNode* setOccupancy(const Key& key, unsigned int depth, float occ, bool lazy = false, bool justCreated = false) {
-      return this->setLogOdds(key, depth, (float) prob2logodds(occ), lazy, justCreated);
+    /**
+     * The same as the other setLogOdds, but the descent continues from the given path (see setOrUpdateLogOdds).
+     */
+    OcNode* setLogOdds(const Key& key, unsigned int depth, float lo, Context& ctx, bool lazy, bool justCreated,
+                       const P* sample, Path& path) {
+      return this->setOrUpdateLogOdds(key, depth, lo, false, ctx, lazy, justCreated, sample, path);
     }
 
-    OcNode*
-    updateOccupancy(const Key& key, unsigned int depth, float occ, bool lazy = false, bool justCreated = false) {
-      return this->updateLogOdds(key, depth, (float) prob2logodds(occ), lazy, justCreated);
+    /**
+     * The same as the other updateLogOdds, but the descent continues from the given path (see setOrUpdateLogOdds).
+     */
+    OcNode* updateLogOdds(const Key& key, unsigned int depth, float lo, Context& ctx, bool lazy, bool justCreated,
+                          const P* sample, Path& path) {
+      return this->setOrUpdateLogOdds(key, depth, lo, true, ctx, lazy, justCreated, sample, path);
+    }
+
+    /**
+     * Updates the log-odds of the nodes represented by the given keys (lazily, so the tree should be fixed
+     * afterwards). The keys should be sorted in Morton order (see MortonLess): consecutive keys share most of
+     * their path, so each descent resumes from the deepest node it shares with the previous one, instead of
+     * restarting at this node.
+     * @param keys The keys representing the target nodes.
+     * @param depth The depth of this node in the tree (counting backwards).
+     * @param lo The log-odds value to use in the updates.
+     * @param ctx The context of the tree.
+     * @param justCreated Whether this node was created because of this update.
+     * @param sample The payload of the measurements, integrated into the updated leaves (nullptr for none).
+     */
+    void updateLogOddsBatch(std::span<const Key> keys, unsigned int depth, float lo, Context& ctx,
+                            bool justCreated = false, const P* sample = nullptr) {
+      this->updateLogOddsBatch(keys, depth, ctx, justCreated, [lo, sample](size_t) {
+        return std::pair<float, const P*>(lo, sample);
+      });
+    }
+
+    /**
+     * The same as the other updateLogOddsBatch, but each key has its own measurement.
+     * @param keys The keys representing the target nodes.
+     * @param depth The depth of this node in the tree (counting backwards).
+     * @param ctx The context of the tree.
+     * @param justCreated Whether this node was created because of this update.
+     * @param measurement Gives the log-odds value and the payload (nullptr for none) of the update of each key:
+     * (index of the key) -> std::pair<float, const P*>.
+     * @param levels The depth of the target node of each key (see descend), or none if they are all voxels. The
+     * volumes of the target nodes can't overlap.
+     */
+    template<class M>
+    void updateLogOddsBatch(std::span<const Key> keys, unsigned int depth, Context& ctx, bool justCreated,
+                            M measurement, std::span<const uint8_t> levels = {}) {
+      Path path;
+      // the log-odds of the reached leaves are updated together, unless a later descent can move them (by
+      // undoing the path compression of their node), i.e. unless the tree can have path compressed nodes
+      LeafUpdates pending;
+      LeafUpdates* leafUpdates = ctx.hasSkips() ? nullptr : &pending;
+      for (size_t i = 0; i < keys.size(); ++i) {
+        const Key& key = keys[i];
+        if (i > 0) {
+          // the levels above the highest different step are shared with the previous key
+          const Key& prev = keys[i - 1];
+          // a repeated key sees the previous update
+          if (key == prev) pending.flush(ctx.stats);
+          path.resume(prev, key);
+        }
+
+        bool created = false;
+        if (path.len == 0) {
+          path.nodes[0] = {this, this->enter(key, depth, justCreated, ctx)};
+          path.len = 1;
+          created = justCreated;
+          justCreated = false;
+        }
+        auto [lo, sample] = measurement(i);
+        OcNode::descend(key, lo, true, ctx, created, sample, path, leafUpdates, levels.empty() ? 0 : levels[i]);
+      }
+      pending.flush(ctx.stats);
+    }
+
+    /**
+     * Checks if 2 keys are in the same subtree at the given depth.
+     * @param a The first key.
+     * @param b The second key.
+     * @param depth The depth of the root of the subtree (counting backwards).
+     * @return True if the keys have the same steps above @param depth. False, otherwise.
+     */
+    static bool sameParent(const Key& a, const Key& b, unsigned int depth) {
+      return (a.get(0) >> depth) == (b.get(0) >> depth) &&
+             (a.get(1) >> depth) == (b.get(1) >> depth) &&
+             (a.get(2) >> depth) == (b.get(2) >> depth);
+    }
+
+    /**
+     * Builds the subtree of this (new) node bottom-up, level by level, from its leaves (voxels). Each inner node
+     * is pruned/updated/compressed as soon as its children are built, like fix() does, so the result is the same
+     * as inserting the leaves top-down and fixing the tree, without the intermediate nodes and re-pruning.
+     * @warning This node should be new: its statistics (and the ones of its subtree) are added by this method.
+     * @param keys The keys of the leaves, sorted in Morton order (see MortonLess) and unique.
+     * @param leaves The leaves, in the same order as their keys.
+     * @param depth The depth of this node in the tree (counting backwards).
+     * @param ctx The context of the tree.
+     * @param levels The depth of each leaf (counting backwards, below this node), or none if they are all voxels.
+     * The volumes of the leaves can't overlap.
+     */
+    void build(std::span<const Key> keys, std::span<const OcNode> leaves, unsigned int depth, Context& ctx,
+               std::span<const uint8_t> levels = {}) {
+      assert(keys.size() == leaves.size() && !keys.empty());
+      assert(levels.empty() || levels.size() == keys.size());
+      for (size_t i = 0; i < leaves.size(); ++i) {
+        ctx.stats.addNodes(levels.empty() ? 0 : levels[i]);
+        ctx.stats.addLeaves(leaves[i].isOccupied());
+      }
+
+      // the nodes of the current level (and the key of one of their leaves), and their depth (if not all the same)
+      std::vector<OcNode> level, parents;
+      std::vector<Key> levelKeys, parentKeys;
+      std::vector<uint8_t> levelDepths, parentDepths;
+      for (unsigned int d = 1; d <= depth; ++d) {
+        parents.clear();
+        parentKeys.clear();
+        parentDepths.clear();
+        for (size_t i = 0, j; i < keys.size(); i = j) {
+          if (!levels.empty() && levels[i] >= d) {
+            // a leaf above this level: it is the only node in its volume, and it's a child of a higher level
+            assert(d < depth);
+            parents.push_back(leaves[i]);
+            parentKeys.push_back(keys[i]);
+            parentDepths.push_back(levels[i]);
+            j = i + 1;
+            continue;
+          }
+
+          // the siblings are contiguous (Morton order)
+          for (j = i + 1; j < keys.size() && OcNode::sameParent(keys[i], keys[j], d); ++j);
+
+          OcNode& parent = (d == depth) ? *this : parents.emplace_back();
+          parent.setChildren(keys.subspan(i, j - i), leaves.subspan(i, j - i), d, ctx);
+          parentKeys.push_back(keys[i]);
+          if (!levels.empty()) parentDepths.push_back((uint8_t) d);
+        }
+        assert(d < depth || parentKeys.size() == 1);
+        std::swap(level, parents);
+        std::swap(levelKeys, parentKeys);
+        std::swap(levelDepths, parentDepths);
+        keys = levelKeys;
+        leaves = level;
+        if (!levels.empty()) levels = levelDepths;
+      }
+    }
+
+    /**
+     * Gives the given children to this (new) node, and prunes/updates/compresses it like fixNode().
+     * @warning This node should be new: its statistics are added by this method (the ones of the children
+     * should have been added already).
+     * @param keys The keys of (any leaf of) each child.
+     * @param children The children, in the same order as their keys.
+     * @param depth The depth of this node in the tree (counting backwards).
+     * @param ctx The context of the tree.
+     */
+    void setChildren(std::span<const Key> keys, std::span<const OcNode> children, unsigned int depth, Context& ctx) {
+      assert(this->childMask == 0 && this->skip == 0);
+      this->allocChildren(ctx);
+      for (size_t i = 0; i < keys.size(); ++i) {
+        unsigned int pos = keys[i].getStep(depth - 1);
+        (*this->children)[pos] = children[i];
+        this->childMask |= (uint8_t) (1 << pos);
+      }
+      ctx.stats.addNodes(depth);
+      this->fixNode(ctx, depth);
+    }
+
+    /**
+     * Gets the child with the given index, ready for a batch of updates below it (see updateLogOddsBatch). The
+     * child is created, or this node is expanded (if it was pruned), as the descents of those updates would do.
+     * @param pos The index of the child (pos < 8).
+     * @param cnt The number of updates.
+     * @param measurement Gives the log-odds value and the payload of each update (see updateLogOddsBatch).
+     * @param depth The depth of this node in the tree (counting backwards). This node can't skip levels.
+     * @param ctx The context of the tree.
+     * @param created Set to whether the child was created.
+     * @return A pointer to the child. nullptr if none of the updates would change this (pruned) node.
+     */
+    template<class M>
+    OcNode* prepareChild(unsigned int pos, size_t cnt, M measurement, unsigned int depth, Context& ctx,
+                         bool& created) {
+      assert(this->skip == 0 && depth > 0);
+      created = false;
+      if (!this->childExists(pos)) {
+        if (this->childMask == 0) {
+          bool changes = false;
+          for (size_t i = 0; i < cnt && !changes; ++i) {
+            auto [lo, sample] = measurement(i);
+            changes = !this->isNoopUpdate(lo, true, sample);
+          }
+          if (!changes) return nullptr;
+          this->expandNode(ctx, depth);
+        } else {
+          this->createChild(pos, ctx, depth);
+          created = true;
+        }
+      }
+      return &(*this->children)[pos];
+    }
+
+    OcNode* setOccupancy(const Key& key, unsigned int depth, float occ, Context& ctx, bool lazy = false,
+                         bool justCreated = false, const P* sample = nullptr) {
+      return this->setLogOdds(key, depth, (float) prob2logodds(occ), ctx, lazy, justCreated, sample);
+    }
+
+    OcNode* updateOccupancy(const Key& key, unsigned int depth, float occ, Context& ctx, bool lazy = false,
+                            bool justCreated = false, const P* sample = nullptr) {
+      return this->updateLogOdds(key, depth, (float) prob2logodds(occ), ctx, lazy, justCreated, sample);
+    }
+
+    /**
+     * Undoes the path compression of this node and its successors, so every level of the subtree is stored.
+     * @param ctx The context of the tree.
+     * @param depth The depth of this node in the tree (counting backwards).
+     */
+    void decompressSubtree(Context& ctx, unsigned int depth) {
+      if (this->getSkipCount() > 0) this->decompress(ctx, depth);
+      for (int i = 0; i < 8; ++i) {
+        if (this->childExists(i)) (*this->children)[i].decompressSubtree(ctx, depth - 1);
+      }
     }
 
     /**
      * Prune children (if possible) and update the log-odds (if inner node).
      * Fixes the tree recursively, and should be called after a batch of lazy sets/updates.
+     * @param ctx The context of the tree.
+     * @param depth The depth of this node in the tree (counting backwards).
      */
-    void fix() {
+    void fix(Context& ctx, unsigned int depth) {
+      // the children are below the skipped levels
+      depth -= this->getSkipCount();
       for (int i = 0; i < 8; ++i) {
         auto child = this->getChild(i);
-        if (child) child->fix();
+        if (child) child->fix(ctx, depth - 1);
       }
+      this->fixNode(ctx, depth);
+    }
+
+    /**
+     * Fixes the tree like fix(), with the subtrees of the top levels fixed in parallel (as OpenMP tasks): the
+     * children of a node are fixed concurrently, each with its own statistics, before the node is pruned/updated.
+     * Each node only depends on its subtree, so the result is the same as fix().
+     * @warning Should be called by a single thread of an OpenMP parallel region (the tasks run on its team).
+     * @param ctx The context of the tree.
+     * @param depth The depth of this node in the tree (counting backwards).
+     * @param levels The number of levels whose children are fixed in parallel (8^levels tasks at most).
+     */
+    void fixTasks(Context& ctx, unsigned int depth, unsigned int levels) {
+      if (levels == 0) {
+        this->fix(ctx, depth);
+        return;
+      }
+
+      // the children are below the skipped levels
+      depth -= this->getSkipCount();
+      std::array<OcTreeStats, 8> childStats;
+      for (int i = 0; i < 8; ++i) {
+        OcNode* child = this->getChild(i);
+        if (child == nullptr) continue;
+        const Context* parentCtx = &ctx;
+        OcTreeStats* stats = &childStats[i];
+#ifdef _OPENMP
+#pragma omp task default(none) firstprivate(child, parentCtx, stats, depth, levels)
+#endif
+        {
+          Context childCtx = *parentCtx;
+          childCtx.stats.reset((unsigned int) parentCtx->stats.nodesPerDepth.size() - 1);
+          child->fixTasks(childCtx, depth - 1, levels - 1);
+          *stats = std::move(childCtx.stats);
+        }
+      }
+#ifdef _OPENMP
+#pragma omp taskwait
+#endif
+
+      for (const auto& stats: childStats) {
+        if (!stats.nodesPerDepth.empty()) ctx.stats.merge(stats);
+      }
+      this->fixNode(ctx, depth);
+    }
+
+    /**
+     * Fixes the nodes on the paths to the given keys, bottom-up, like fix() does, without visiting the rest of
+     * the subtree: the other nodes should be fixed already (i.e. they weren't changed by lazy sets/updates
+     * since they were last fixed), so the result is the same as fixing the whole subtree.
+     * @param keys The keys of the (lazily) set/updated nodes in the subtree of this node, sorted in Morton order
+     * (see MortonLess). Repeated keys, and keys whose nodes don't exist anymore, are allowed.
+     * @param depth The depth of this node in the tree (counting backwards).
+     * @param ctx The context of the tree.
+     */
+    void fixPaths(std::span<const Key> keys, unsigned int depth, Context& ctx) {
+      if (keys.empty() || this->childMask == 0) return;
+      if (this->skip != 0) {
+        // only the keys that follow the skipped levels reach the children (they're contiguous)
+        auto follows = [&](const Key& key) { return this->followsSkip(key, depth); };
+        auto first = std::find_if(keys.begin(), keys.end(), follows);
+        auto last = std::find_if_not(first, keys.end(), follows);
+        keys = keys.subspan(first - keys.begin(), last - first);
+        // the children are below the skipped levels
+        depth -= this->getSkipCount();
+      }
+
+      for (size_t i = 0, j; i < keys.size(); i = j) {
+        // the keys of each child are contiguous (Morton order)
+        unsigned int pos = keys[i].getStep(depth - 1);
+        for (j = i + 1; j < keys.size() && keys[j].getStep(depth - 1) == pos; ++j);
+        OcNode* child = this->getChild(pos);
+        if (child != nullptr) child->fixPaths(keys.subspan(i, j - i), depth - 1, ctx);
+      }
+      if (ctx.pathCompression) this->compressChildren(ctx, depth);
+      this->fixNode(ctx, depth);
+    }
 
+    /**
+     * Prunes (if possible) or updates the log-odds of this node from its children, without fixing the
+     * children (they should be fixed already).
+     * @param ctx The context of the tree.
+     * @param depth The depth of this node in the tree, below its skipped levels (counting backwards).
+     */
+    void fixNode(Context& ctx, unsigned int depth) {
       // prune if possible
-      if (this->prune()) return;
+      if (this->prune(ctx, depth)) return;
       // updated occupancy if not pruned
       this->updateBasedOnChildren();
+      if (ctx.pathCompression) this->compress(ctx, depth + this->getSkipCount());
     }
 
     /**
@@ -412,13 +1452,19 @@ namespace octomap {
      * @return A pointer to the OcNode represented by the given key in the tree.
      */
     OcNode* search(const Key& key, unsigned int depth) {
+      if (this->skip != 0) {
+        // the skipped levels have children, so the search fails if the key leaves them
+        if (!this->followsSkip(key, depth)) return nullptr;
+        depth -= this->getSkipCount();
+      }
+
       if (depth > 0) {
         unsigned int d = depth - 1;
         unsigned int pos = key.getStep(d);
         OcNode* child = this->getChild(pos);
         if (child != nullptr) // child exists
           return child->search(key, d);
-        else if (!this->hasChildren()) // we're a leaf (children pruned)
+        else if (this->childMask == 0) // we're a leaf (children pruned)
           return this;
         else // search failed
           return nullptr;
@@ -427,6 +1473,35 @@ namespace octomap {
       }
     }
 
+    /**
+     * The same as the other search, but the search continues from the given path, and the nodes on the way are
+     * added to it (so the next search can continue from them, see Path::resume).
+     * @param key The key representing the wanted node.
+     * @param depth The depth of this node in the tree (counting backwards).
+     * @param path The path of a previous descent from this node (or an empty path).
+     * @return A pointer to the OcNode represented by the given key in the tree.
+     */
+    OcNode* search(const Key& key, unsigned int depth, Path& path) {
+      if (path.len == 0) {
+        // the skipped levels have children, so the search fails if the key leaves them
+        if (this->skip != 0 && !this->followsSkip(key, depth)) return nullptr;
+        path.nodes[0] = {this, depth - this->getSkipCount()};
+        path.len = 1;
+      }
+
+      auto [node, d] = path.nodes[path.len - 1];
+      while (d > 0) {
+        OcNode* child = node->getChild(key.getStep(d - 1));
+        if (child == nullptr) // we're a leaf (children pruned), or the search failed
+          return node->childMask == 0 ? node : nullptr;
+        if (child->skip != 0 && !child->followsSkip(key, d - 1)) return nullptr;
+        node = child;
+        d = d - 1 - child->getSkipCount();
+        path.nodes[path.len++] = {node, d};
+      }
+      return node;
+    }
+
     /**
      * Checks if 2 nodes are equal.
      * 2 OcNodes are equal if they have the same (strictly) log-odds.
@@ -453,6 +1528,31 @@ namespace octomap {
      * @param os The output stream to write to.
      */
     void writeBinary(std::ostream& os) const {
+      // path compressed nodes are written as the chain of single-child nodes they skip
+      for (unsigned int i = 0; i < this->getSkipCount(); ++i) {
+        unsigned int pos = this->getSkipStep(i);
+        std::bitset<8> chainBitsets[2];
+        std::bitset<8>& childBitset = chainBitsets[pos / 4];
+        unsigned int bit = (pos % 4) * 2;
+        if (i + 1 < this->getSkipCount() || this->childMask != 0) {
+          // 11 : child has children
+          childBitset[bit] = 1;
+          childBitset[bit + 1] = 1;
+        } else if (this->isOccupied()) {
+          // 01 : child is occupied node (the chain ends in a leaf)
+          childBitset[bit + 1] = 1;
+        } else {
+          // 10 : child is free node (the chain ends in a leaf)
+          childBitset[bit] = 1;
+        }
+
+        char child1to4_char = (char) chainBitsets[0].to_ulong();
+        char child5to8_char = (char) chainBitsets[1].to_ulong();
+        os.write((char*) &child1to4_char, sizeof(char));
+        os.write((char*) &child5to8_char, sizeof(char));
+      }
+      if (this->skip != 0 && this->childMask == 0) return;
+
       std::bitset<8> child1to4;
       std::bitset<8> child5to8;
 
@@ -474,6 +1574,12 @@ namespace octomap {
       }
     }
   };
+
+  // the children pointer (8 bytes), the log-odds, the child mask and the skipped levels (see OcNode::Skip)
+  static_assert(sizeof(OcNode<uint16_t, float>) == 16, "Unexpected size of the float nodes");
+  static_assert(sizeof(OcNode<uint16_t, int16_t>) == 12, "Unexpected size of the int16_t nodes");
 }
 
+#pragma pack(pop)
+
 #endif //SLAM_OCNODE_H
@@ -4,6 +4,8 @@
 #include <bitset>
 #include <cassert>
 #include <cinttypes>
+#include <cmath>
+#include <type_traits>
 
 #include "../parallel_hashmap/phmap_utils.h"
 
@@ -15,28 +17,35 @@ namespace octomap {
   private:
     T k[3];
 
-    inline static unsigned int maxCoord = 32768;
-    inline static double resolution = 0.1;
-    inline static double resolution_factor = 10.0; // 1.0 / resolution
-
-    constexpr static T coord2key(float coord) {
-      return (T) floor(resolution_factor * coord) + maxCoord;
+    /** Moves bit i of @param v to bit 3i. */
+    static uint64_t spreadBits(uint64_t v) {
+      v &= 0x1FFFFF;
+      v = (v | (v << 32)) & 0x1F00000000FFFF;
+      v = (v | (v << 16)) & 0x1F0000FF0000FF;
+      v = (v | (v << 8)) & 0x100F00F00F00F00F;
+      v = (v | (v << 4)) & 0x10C30C30C30C30C3;
+      v = (v | (v << 2)) & 0x1249249249249249;
+      return v;
     }
 
-    [[nodiscard]] constexpr static float key2coord(T key) {
-      return (0.5 - float(maxCoord) + key) * resolution;
+    /** Moves bit 3i of @param v to bit i (the inverse of spreadBits). */
+    static uint64_t compactBits(uint64_t v) {
+      v &= 0x1249249249249249;
+      v = (v | (v >> 2)) & 0x10C30C30C30C30C3;
+      v = (v | (v >> 4)) & 0x100F00F00F00F00F;
+      v = (v | (v >> 8)) & 0x1F0000FF0000FF;
+      v = (v | (v >> 16)) & 0x1F00000000FFFF;
+      v = (v | (v >> 32)) & 0x1FFFFF;
+      return v;
     }
 
   public:
     constexpr static unsigned int size = (unsigned int) sizeof(T) * 8;
 
-    explicit OcNodeKey(const Vector3<>& p) : k{
-        coord2key(p[0]),
-        coord2key(p[1]),
-        coord2key(p[2])
-    } {}
+    OcNodeKey(T x, T y, T z) : k{x, y, z} {}
 
-    OcNodeKey() : OcNodeKey(Vector3()) {}
+    /** The key of the origin (the center of a tree as deep as the key has bits), as before the key converter */
+    OcNodeKey() : OcNodeKey((T) (T(1) << (size - 1)), (T) (T(1) << (size - 1)), (T) (T(1) << (size - 1))) {}
 
     OcNodeKey(const OcNodeKey& other) :
         k{(T) other[0], (T) other[1], (T) other[2]} {};
@@ -58,20 +67,31 @@ namespace octomap {
              bool(this->get(2) & mask) * 4;
     }
 
-    [[nodiscard]] float toCoord(unsigned int i) const {
-      return OcNodeKey::key2coord(this->get(i));
+    [[nodiscard]] unsigned long hash() const {
+      return phmap::HashState::combine(0, this->get(0), this->get(1), this->get(2));
     }
 
-    [[nodiscard]] Vector3<> toCoord() const {
-      return {
-          this->toCoord(0),
-          this->toCoord(1),
-          this->toCoord(2),
-      };
+    /**
+     * Interleaves the bits of the components (x on the lowest bit of each level, like the steps) in
+     * a Morton code. Sorting the codes sorts the keys in Morton order (see MortonLess).
+     * @return The Morton code of the key.
+     */
+    [[nodiscard]] uint64_t mortonCode() const {
+      static_assert(size <= 21, "The Morton code of the key doesn't fit in 64 bits");
+      return OcNodeKey::spreadBits(this->get(0)) |
+             (OcNodeKey::spreadBits(this->get(1)) << 1) |
+             (OcNodeKey::spreadBits(this->get(2)) << 2);
     }
 
-    [[nodiscard]] unsigned long hash() const {
-      return phmap::HashState::combine(0, this->get(0), this->get(1), this->get(2));
+    /**
+     * Creates the key with the given Morton code (the inverse of mortonCode).
+     * @param code The Morton code of the key.
+     * @return The key.
+     */
+    static OcNodeKey fromMortonCode(uint64_t code) {
+      static_assert(size <= 21, "The Morton code of the key doesn't fit in 64 bits");
+      return OcNodeKey((T) OcNodeKey::compactBits(code), (T) OcNodeKey::compactBits(code >> 1),
+                       (T) OcNodeKey::compactBits(code >> 2));
     }
 
     const T& operator[](unsigned int i) const {
@@ -101,15 +121,6 @@ namespace octomap {
                  " " << std::bitset<bitCnt>(key[2]) << ")";
     }
 
-    static void setMaxCoord(unsigned int mc) {
-      maxCoord = mc;
-    }
-
-    static void setResolution(double r) {
-      resolution = r;
-      resolution_factor = 1.0 / r;
-    }
-
     struct Cmp {
       bool operator()(const OcNodeKey& a, const OcNodeKey& b) const {
         return a == b;
@@ -129,28 +140,15 @@ namespace octomap {
     using BitSet = std::bitset<T>;
     BitSet k[3];
 
-    inline static unsigned int maxCoord = 32768;
-    inline static double resolution = 0.1;
-    inline static double resolution_factor = 10.0; // 1.0 / resolution
-
-    static constexpr unsigned long coord2key(float coord) {
-      return (unsigned long) floor(resolution_factor * coord) + maxCoord;
-    }
-
-    [[nodiscard]] constexpr static float key2coord(BitSet key) {
-      return (0.5 - float(maxCoord) + key) * resolution;
-    }
-
   public:
     constexpr static unsigned int size = (unsigned int) T;
 
-    explicit OcNodeKey(const Vector3<>& p) : k{
-        BitSet(coord2key(p[0])),
-        BitSet(coord2key(p[1])),
-        BitSet(coord2key(p[2]))
-    } {}
+    OcNodeKey(unsigned long x, unsigned long y, unsigned long z) : k{BitSet(x), BitSet(y), BitSet(z)} {}
 
-    OcNodeKey() : OcNodeKey(Vector3()) {}
+    /** The key of the origin (the center of a tree as deep as the key has bits), as before the key converter */
+    OcNodeKey() {
+      for (auto& c: this->k) c.set(size - 1);
+    }
 
     OcNodeKey(const OcNodeKey& other) :
         OcNodeKey(other[0], other[1], other[2]) {};
@@ -172,18 +170,6 @@ namespace octomap {
              bool(this->k[2] & mask) * 4;
     }
 
-    [[nodiscard]] float toCoord(unsigned int i) const {
-      return OcNodeKey::key2coord(this->k[i]);
-    }
-
-    [[nodiscard]] Vector3<> toCoord() const {
-      return {
-          this->toCoord(0),
-          this->toCoord(1),
-          this->toCoord(2),
-      };
-    }
-
     [[nodiscard]] unsigned long hash() const {
       return phmap::HashState::combine(0, this->k[0], this->k[1], this->k[2]);
     }
@@ -244,15 +230,6 @@ namespace octomap {
                  " " << key[2] << ")";
     }
 
-    static void setMaxCoord(unsigned int mc) {
-      maxCoord = mc;
-    }
-
-    static void setResolution(double r) {
-      resolution = r;
-      resolution_factor = 1.0 / r;
-    }
-
     struct Cmp {
       bool operator()(const OcNodeKey& a, const OcNodeKey& b) const {
         return a == b;
@@ -265,6 +242,99 @@ namespace octomap {
       }
     };
   };
+
+  /**
+   * Orders keys in Morton (Z) order, from the top level of the tree down. The keys of a subtree are
+   * contiguous in this order, so consecutive keys share most of their path in the tree.
+   * The children are ordered by their step (see OcNodeKey::getStep), like the children of a node.
+   * @tparam KEY The type of the keys.
+   */
+  template<class KEY>
+  struct MortonLess {
+    bool operator()(const KEY& a, const KEY& b) const {
+      // the component with the most significant different bit decides (z wins ties: it has the biggest
+      // weight in the steps)
+      unsigned int dim = 2;
+      unsigned long maxDiff = 0;
+      for (int i = 2; i >= 0; --i) {
+        unsigned long diff = (unsigned long) a.get(i) ^ (unsigned long) b.get(i);
+        // checks if the most significant bit of maxDiff is lower than the one of diff
+        if (maxDiff < diff && maxDiff < (maxDiff ^ diff)) {
+          dim = i;
+          maxDiff = diff;
+        }
+      }
+      return a.get(dim) < b.get(dim);
+    }
+  };
+
+  /**
+   * Converts between coordinates (in meters) and keys. The conversion depends on the depth and resolution
+   * of a tree, so each tree (Octomap) owns its converter: trees with different parameters can coexist
+   * (and be updated concurrently).
+   * @tparam T The type of the components of the keys.
+   */
+  template<typename T = uint16_t>
+  class OcNodeKeyConverter {
+  private:
+    using Key = OcNodeKey<T>;
+
+    /** The key of the coordinate 0 (the center of the tree) */
+    unsigned int maxCoord;
+    double resolution;
+    double resolutionFactor; // 1.0 / resolution
+
+    [[nodiscard]] auto coord2key(float coord) const {
+      if constexpr (std::is_integral_v<T>)
+        return (T) ((T) floor(this->resolutionFactor * coord) + this->maxCoord);
+      else
+        return (unsigned long) floor(this->resolutionFactor * coord) + this->maxCoord;
+    }
+
+  public:
+    /**
+     * Instantiates a converter for a tree with the given depth and resolution.
+     * @param depth The max depth of the tree.
+     * @param resolution The size of the voxels (in meters).
+     */
+    OcNodeKeyConverter(unsigned int depth, double resolution) :
+        maxCoord(1u << (depth - 1)), resolution(resolution), resolutionFactor(1.0 / resolution) {}
+
+    /**
+     * Calculates the key of the voxel containing the given location.
+     * @param p The location to convert.
+     * @return The key of the voxel containing @param p.
+     */
+    [[nodiscard]] Key toKey(const Vector3<>& p) const {
+      return Key(this->coord2key(p[0]), this->coord2key(p[1]), this->coord2key(p[2]));
+    }
+
+    /**
+     * Calculates the coordinate of the center of the voxel with the given key component.
+     * @param key The component of the key to convert.
+     * @return The coordinate of the center of the voxel.
+     */
+    [[nodiscard]] float toCoord(unsigned long key) const {
+      return (float) ((0.5 - float(this->maxCoord) + key) * this->resolution);
+    }
+
+    /**
+     * Calculates the location of the center of the voxel with the given key.
+     * @param key The key to convert.
+     * @return The location of the center of the voxel.
+     */
+    [[nodiscard]] Vector3<> toCoord(const Key& key) const {
+      return {
+          this->toCoord(key.get(0)),
+          this->toCoord(key.get(1)),
+          this->toCoord(key.get(2)),
+      };
+    }
+
+    [[nodiscard]] double getResolution() const {
+      return this->resolution;
+    }
+  };
 }
 
 #endif //SLAM_OCNODEKEY_H
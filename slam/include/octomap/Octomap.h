@@ -1,10 +1,16 @@
 #ifndef SLAM_OCTOMAP_H
 #define SLAM_OCTOMAP_H
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
+#include <memory>
+#include <span>
 #include <unordered_set>
 #include <vector>
 #include <fstream>
+#include <iterator>
 
 #ifdef _OPENMP
 
@@ -16,26 +22,338 @@
 #include "OcNode.h"
 #include "OcNodeKey.h"
 #include "OctomapIterator.h"
+#include "RadixSort.h"
 #include "Vector3.h"
 #include "../HashTable/HashTable.h"
+#include "../parallel_hashmap/phmap.h"
 
 #define DFLT_RESOLUTION 0.1
+/** The number of levels (from the root) whose subtrees are fixed in parallel by a full fix */
+#define FIX_TASK_LEVELS 3u
+/** The number of recent Morton codes each thread remembers to discard repeated nodes early (power of 2) */
+#define RECENT_CODES 16384u
 
 namespace octomap {
-  template<typename T = uint16_t>
+  /**
+   * How pointcloudUpdate integrates the rays of a point cloud.
+   */
+  enum class PointcloudMode {
+    /** Each voxel is updated once: occupied if a ray ends in it, free if rays only cross it (default) */
+    UNIQUE,
+    /**
+     * The rays that end in (hits) and cross (misses) each voxel are counted, and the voxel is updated once
+     * with the log-odds of all of them: hits * occupied log-odds, or misses * free log-odds if no ray ends in
+     * it (the hits still have priority). Closer to integrating the rays one by one.
+     * @note The payload sample is integrated once into each voxel with hits, like the other modes (e.g. a
+     * CountPayload counts the point cloud once, not its hits).
+     */
+    COUNT,
+    /**
+     * The same updates as UNIQUE, but the repeated voxels are discarded by sorting their Morton codes (see
+     * radixSort) instead of inserting them in hash sets. Every step is a pass over flat arrays, and the updates
+     * come out sorted. Used as UNIQUE if the Morton codes of the keys don't fit in 64 bits.
+     */
+    SORTED
+  };
+
+  /**
+   * Probabilistic occupancy map stored in an octree.
+   * @tparam T The type of the components of the keys.
+   * @tparam V The type used to store the log-odds of the nodes (see OcNode). Using int16_t
+   * quantizes the log-odds to fixed-point, reducing the memory used by each node (from 16 to 12 bytes).
+   * @tparam P The payload stored in each voxel besides its occupancy (see VoxelPayload.h). By default,
+   * only the occupancy is stored.
+   */
+  template<typename T = uint16_t, typename V = float, class P = OccupancyPayload>
   class Octomap {
+  public:
+    using Payload = P;
+
+    /**
+     * The path of the last search (or set/update) of its owner, and its key: the next one continues from the deepest
+     * node they share (see OcNode::Path::resume), instead of the root. Consecutive keys are usually close (e.g. the
+     * voxels of a ray). Owned by the caller (e.g. one for each thread, see search(const Key&, Finger&)). It can be
+     * used with any tree, but it only speeds up consecutive descents on the same tree. Aligned to avoid false sharing
+     * between threads.
+     */
+    struct alignas(64) Finger {
+      OcNodeKey<T> key;
+      typename OcNode<T, V, P>::Path path;
+      /** The tree the path was recorded on, and its version */
+      const Octomap* tree = nullptr;
+      size_t version = 0;
+    };
+
   private:
     using Key = OcNodeKey<T>;
     using KeySet = HashTable::HashTable<Key>;
-    using Node = OcNode<T>;
+    using Node = OcNode<T, V, P>;
+    using Context = typename Node::Context;
 
     /** The max depth of tree */
     const unsigned int depth;
     /** The same represented by a leaf node/voxel (in meters) */
     const double resolution;
+    /** Converts the locations to keys of this tree (and back) */
+    const OcNodeKeyConverter<T> keyConverter;
 
     std::vector<double> stepLookupTable;
+    /** Owns the memory of all the nodes in the tree (except the root) */
+    MemoryPool<typename Node::ChildBlock> blocks;
+    Context context;
     Node* rootNode = nullptr;
+    /** The keys of the lazy sets/updates since the last fix: only their paths need to be fixed */
+    std::vector<Key> dirtyKeys;
+    /** Whether the next fix has to visit the whole tree (e.g. the prune mode changed) */
+    bool fullFixPending = false;
+    PointcloudMode pointcloudMode = PointcloudMode::UNIQUE;
+    /** Whether the free voxels that fill the volume of a coarser node are updated at its level (see carveFreeSpace) */
+    bool freeSpaceCarving = false;
+    /** The insertion level of the measurements of pointcloudUpdate by range (see setInsertionLevels) */
+    std::vector<std::pair<double, unsigned int>> insertionLevels;
+    /** Whether the free nodes of the rays inside stable free leaves are skipped (see setStableFreeSkipping) */
+    bool stableFreeSkipping = false;
+
+    /** The finger of the single sets/updates (they can't run concurrently, so they share it) */
+    Finger updateFinger;
+    /**
+     * Changes whenever the nodes on the paths of the fingers can be moved or deleted (e.g. by a fix). Unique among
+     * the trees of the process (see newVersion).
+     */
+    size_t version = Octomap::newVersion();
+
+    /**
+     * Helper method that gets a new version of a tree. The versions come from a counter shared by all the trees, so
+     * a finger never matches a tree it wasn't recorded on (e.g. a new tree at the address of a destroyed one).
+     * @return A version that wasn't used before (never 0, the version of a new finger).
+     */
+    static size_t newVersion() {
+      static std::atomic<size_t> lastVersion = 0;
+      return lastVersion.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+
+    /**
+     * Helper method that calculates the memory allocated by a vector.
+     * @param v The vector.
+     * @return The capacity of the vector in bytes.
+     */
+    template<class E>
+    static size_t capacityBytes(const std::vector<E>& v) {
+      return v.capacity() * sizeof(E);
+    }
+
+    /**
+     * Helper method that calculates the memory allocated by a (flat) hash map: its slots and their control bytes.
+     * @param map The hash map.
+     * @return The capacity of the map in bytes.
+     */
+    template<class M>
+    static size_t mapBytes(const M& map) {
+      return map.capacity() * (sizeof(typename M::value_type) + 1);
+    }
+
+    /**
+     * A batch of updates of distinct keys, sorted in Morton order. Each update has its own log-odds value, and
+     * the hits (occupied measurements) integrate the payload sample.
+     */
+    struct KeyUpdates {
+      std::vector<Key> keys;
+      std::vector<float> logOdds;
+      /** Whether each update is a hit (only recorded if there's a sample) */
+      std::vector<bool> hits;
+      /** The depth of the target node of each update (see carveFreeSpace). Empty if they are all voxels. */
+      std::vector<uint8_t> levels;
+      const Payload* sample = nullptr;
+
+      void reserve(size_t n) {
+        this->keys.reserve(n);
+        this->logOdds.reserve(n);
+        if (this->sample != nullptr) this->hits.reserve(n);
+      }
+
+      void clear() {
+        this->keys.clear();
+        this->logOdds.clear();
+        this->hits.clear();
+        this->levels.clear();
+      }
+
+      void add(const Key& key, float lo, bool hit) {
+        this->keys.push_back(key);
+        this->logOdds.push_back(lo);
+        if (this->sample != nullptr) this->hits.push_back(hit);
+      }
+
+      /**
+       * Gets the measurement of an update (see OcNode::updateLogOddsBatch).
+       * @param i The index of the update.
+       * @return The log-odds value of the update, and its payload (nullptr for none).
+       */
+      [[nodiscard]] std::pair<float, const Payload*> measurement(size_t i) const {
+        return {this->logOdds[i], this->sample != nullptr && this->hits[i] ? this->sample : nullptr};
+      }
+
+      /**
+       * @return The memory (in bytes) allocated by the updates.
+       */
+      [[nodiscard]] size_t memoryUsage() const {
+        return Octomap::capacityBytes(this->keys) + Octomap::capacityBytes(this->logOdds) +
+               this->hits.capacity() / 8 + Octomap::capacityBytes(this->levels);
+      }
+    };
+
+    /** The number of rays that end in (hits) and cross (misses) a voxel */
+    struct RayCount {
+      uint32_t hits = 0;
+      uint32_t misses = 0;
+    };
+
+    struct KeyHash {
+      size_t operator()(const Key& key) const {
+        return key.hash();
+      }
+    };
+
+    using RayCountMap = phmap::flat_hash_map<Key, RayCount, KeyHash>;
+
+    /**
+     * The memory a thread uses to integrate the rays of a point cloud (see PointcloudScratch). Aligned to avoid
+     * false sharing between threads.
+     */
+    struct alignas(64) RayScratch {
+      /** The free nodes of the current ray (see freeRayNodes), and their levels */
+      std::vector<Key> ray;
+      std::vector<uint8_t> levels;
+      /** The nodes of the rays of the thread, for PointcloudMode::UNIQUE */
+      KeySet freeNodes, occupiedNodes;
+      /** The rays of the thread through each node, for PointcloudMode::COUNT */
+      RayCountMap counts;
+      /** The Morton codes of the nodes of the rays of the thread, for PointcloudMode::SORTED */
+      std::vector<uint64_t> freeCodes, occupiedCodes, recentCodes;
+      /** Tags the recent codes of the current call (see pointcloudSortedUpdate) */
+      uint64_t recentGeneration = 0;
+      /** The finger of the searches of the thread (see removeStableFree) */
+      Finger finger;
+
+      /**
+       * @return The memory (in bytes) allocated by the thread, besides the struct itself.
+       */
+      [[nodiscard]] size_t memoryUsage() const {
+        return Octomap::capacityBytes(this->ray) + Octomap::capacityBytes(this->levels) +
+               this->freeNodes.memoryUsage().total() + this->occupiedNodes.memoryUsage().total() +
+               Octomap::mapBytes(this->counts) + Octomap::capacityBytes(this->freeCodes) +
+               Octomap::capacityBytes(this->occupiedCodes) + Octomap::capacityBytes(this->recentCodes);
+      }
+    };
+
+    /**
+     * The memory used by pointcloudUpdate. It's kept between the calls (cleared, not freed), so it grows to the size
+     * of the usual point clouds and is then reused, instead of being allocated for each one (e.g. Sonar updates a
+     * small point cloud for each beam). Freed by shrink().
+     */
+    struct PointcloudScratch {
+      /** The memory of each thread (one for each thread that can run) */
+      std::vector<RayScratch> threads;
+      KeySet freeNodes, occupiedNodes;
+      std::vector<Key> freeKeys, occupiedKeys;
+      std::vector<std::pair<Key, RayCount>> counts;
+      std::vector<uint64_t> freeCodes, occupiedCodes, sortBuffer;
+      KeyUpdates updates;
+      /** The voxels of the endpoints of discretizedPointcloudUpdate, and the first endpoint in each of them */
+      KeySet endpoints;
+      std::vector<Vector3f> discretizedPc;
+
+      /**
+       * @return The memory (in bytes) allocated by pointcloudUpdate.
+       */
+      [[nodiscard]] size_t memoryUsage() const {
+        size_t bytes = sizeof(PointcloudScratch) + Octomap::capacityBytes(this->threads);
+        for (const RayScratch& thread: this->threads) bytes += thread.memoryUsage();
+        return bytes + this->freeNodes.memoryUsage().total() + this->occupiedNodes.memoryUsage().total() +
+               Octomap::capacityBytes(this->freeKeys) + Octomap::capacityBytes(this->occupiedKeys) +
+               Octomap::capacityBytes(this->counts) + Octomap::capacityBytes(this->freeCodes) +
+               Octomap::capacityBytes(this->occupiedCodes) + Octomap::capacityBytes(this->sortBuffer) +
+               this->updates.memoryUsage() + this->endpoints.memoryUsage().total() +
+               Octomap::capacityBytes(this->discretizedPc);
+      }
+    };
+
+    /** Created by the first pointcloudUpdate (see getScratch) */
+    std::unique_ptr<PointcloudScratch> scratch;
+
+    /**
+     * Helper method that gets the memory of pointcloudUpdate (see PointcloudScratch), with one RayScratch for each
+     * thread that can run.
+     * @return The memory of pointcloudUpdate.
+     */
+    PointcloudScratch& getScratch() {
+#ifdef _OPENMP
+      size_t threadCnt = omp_get_max_threads();
+#else
+      size_t threadCnt = 1;
+#endif
+      if (this->scratch == nullptr) this->scratch = std::make_unique<PointcloudScratch>();
+      // replaced instead of resized (the key sets can't be moved)
+      if (this->scratch->threads.size() < threadCnt) this->scratch->threads = std::vector<RayScratch>(threadCnt);
+      return *this->scratch;
+    }
+
+    /**
+     * Helper method that gets the given finger ready for a descent to the given key: its path only keeps the nodes
+     * that contain the key (and it's empty if it was recorded on another tree, or the tree changed since).
+     * @param finger The finger of the descent.
+     * @param key The key of the descent.
+     */
+    void resumeFinger(Finger& finger, const Key& key) const {
+      if (finger.tree != this || finger.version != this->version) finger.path.len = 0;
+      else finger.path.resume(finger.key, key);
+      finger.key = key;
+      finger.tree = this;
+      finger.version = this->version;
+    }
+
+    /**
+     * Helper method that records the keys whose paths have to be fixed by the next fix. Once there are more keys
+     * than stored nodes, fixing the whole tree visits fewer nodes, so the keys are dropped and the next fix is a
+     * full fix (this also bounds the memory of the keys).
+     * @param keys The keys of the lazy sets/updates.
+     */
+    void addDirtyKeys(std::span<const Key> keys) {
+      if (this->fullFixPending) return;
+      if (this->dirtyKeys.size() + keys.size() > this->context.stats.getStoredNodes()) {
+        this->dirtyKeys.clear();
+        this->fullFixPending = this->rootNode != nullptr;
+        return;
+      }
+      this->dirtyKeys.insert(this->dirtyKeys.end(), keys.begin(), keys.end());
+    }
+
+    /**
+     * Helper method that sets/updates the log-odds value of the node/location represented by @param key, starting
+     * at the finger of the last set/update (see Finger).
+     * @param key The key that represents the target node/location.
+     * @param lo The log-odds value to use.
+     * @param isUpdate Whether this is an update (true) or a set (false).
+     * @param lazy Whether or not to lazy eval.
+     * @param sample The payload of the measurement, integrated into the node (nullptr for none).
+     * @return Pointer to the updated node.
+     */
+    Node* setOrUpdateLogOdds(const Key& key, float lo, bool isUpdate, bool lazy, const Payload* sample) {
+      bool createdRoot = this->createRootIfNeeded();
+      if (lazy) this->addDirtyKeys(std::span<const Key>(&key, 1));
+      this->resumeFinger(this->updateFinger, key);
+      typename Node::Path& path = this->updateFinger.path;
+      Node* node;
+      if (isUpdate)
+        node = this->rootNode->updateLogOdds(key, this->depth, lo, this->context, lazy, createdRoot, sample, path);
+      else
+        node = this->rootNode->setLogOdds(key, this->depth, lo, this->context, lazy, createdRoot, sample, path);
+      // the path of the finger was kept up to date, but the other fingers can be outdated (e.g. one of their nodes
+      // doesn't skip levels anymore)
+      this->version = Octomap::newVersion();
+      this->updateFinger.version = this->version;
+      return node;
+    }
 
     /**
      * Helper method that checks whether the root node exists and creates it if necessary.
@@ -44,11 +362,598 @@ namespace octomap {
     bool createRootIfNeeded() {
       if (this->rootNode == nullptr) {
         this->rootNode = new Node();
+        this->context.stats.addNodes(this->depth);
+        this->context.stats.addLeaves(this->rootNode->isOccupied());
         return true;
       }
       return false;
     }
 
+    /**
+     * Helper method that sorts elements by their keys, in Morton order (see MortonLess). Small keys are sorted by
+     * their (precomputed) Morton code, which is much cheaper than comparing the keys.
+     * @param elems The elements to sort.
+     * @param keyOf Gives the key of an element.
+     */
+    template<class E, class KeyOf>
+    static void sortMorton(std::span<E> elems, KeyOf keyOf) {
+      if constexpr (std::is_integral_v<T> && Key::size <= 21) {
+        std::vector<std::pair<uint64_t, E>> codes;
+        codes.reserve(elems.size());
+        for (const E& elem: elems) codes.emplace_back(keyOf(elem).mortonCode(), elem);
+        std::sort(codes.begin(), codes.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+        for (size_t i = 0; i < elems.size(); ++i) elems[i] = codes[i].second;
+      } else {
+        MortonLess<Key> less;
+        std::sort(elems.begin(), elems.end(), [&](const E& a, const E& b) { return less(keyOf(a), keyOf(b)); });
+      }
+    }
+
+    static void sortMorton(std::span<Key> keys) {
+      Octomap::sortMorton(keys, [](const Key& key) -> const Key& { return key; });
+    }
+
+    /**
+     * Helper method that splits keys sorted in Morton order by the child of the root they belong to (they
+     * are contiguous).
+     * @param keys The keys to split.
+     * @return The index of the first key of each child, followed by the number of keys.
+     */
+    [[nodiscard]] std::array<size_t, 9> splitByOctant(std::span<const Key> keys) const {
+      std::array<size_t, 9> bounds{};
+      size_t i = 0;
+      for (unsigned int o = 0; o < 8; ++o) {
+        bounds[o] = i;
+        while (i < keys.size() && keys[i].getStep(this->depth - 1) == o) ++i;
+      }
+      bounds[8] = i;
+      assert(i == keys.size());
+      return bounds;
+    }
+
+    /**
+     * Helper method that builds the (empty) tree bottom-up from its leaves (see OcNode::build). The subtrees of
+     * the children of the root are built in parallel (each thread owns a disjoint subtree), and the root last.
+     * @param keys The keys of the leaves, sorted in Morton order and unique.
+     * @param leaves The leaves, in the same order as their keys.
+     * @param levels The depth of each leaf, or none if they are all voxels (see OcNode::build).
+     */
+    void buildParallel(std::span<const Key> keys, std::span<const Node> leaves, std::span<const uint8_t> levels) {
+      assert(this->rootNode == nullptr && !keys.empty());
+      this->rootNode = new Node();
+      if (this->depth < 2) {
+        this->rootNode->build(keys, leaves, this->depth, this->context, levels);
+        return;
+      }
+
+      auto bounds = this->splitByOctant(keys);
+      std::array<Node, 8> children;
+      std::array<OcTreeStats, 8> childStats;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) default(none) shared(keys, leaves, levels, bounds, children, childStats)
+#endif
+      for (int o = 0; o < 8; ++o) {
+        size_t cnt = bounds[o + 1] - bounds[o];
+        if (cnt == 0) continue;
+        Context ctx = this->context;
+        ctx.stats.reset(this->depth);
+        children[o].build(keys.subspan(bounds[o], cnt), leaves.subspan(bounds[o], cnt), this->depth - 1, ctx,
+                          levels.empty() ? levels : levels.subspan(bounds[o], cnt));
+        childStats[o] = std::move(ctx.stats);
+      }
+
+      std::vector<Key> childKeys;
+      std::vector<Node> builtChildren;
+      for (unsigned int o = 0; o < 8; ++o) {
+        if (bounds[o] == bounds[o + 1]) continue;
+        this->context.stats.merge(childStats[o]);
+        childKeys.push_back(keys[bounds[o]]);
+        builtChildren.push_back(children[o]);
+      }
+      this->rootNode->setChildren(childKeys, builtChildren, this->depth, this->context);
+    }
+
+    /**
+     * Helper method that applies a batch of updates (lazy), and fixes their paths. The subtrees of the children of
+     * the root are updated and fixed in parallel (each thread owns a disjoint subtree, with its own statistics),
+     * and the root is fixed last. The result is the same as updating the keys one by one and fixing the tree.
+     * @warning The root can't skip levels (path compression), and there can't be other paths to fix.
+     * @param updates The updates to apply.
+     */
+    void updateParallel(const KeyUpdates& updates) {
+      assert(this->rootNode != nullptr && !this->rootNode->skipsLevels() && this->depth >= 2);
+      auto bounds = this->splitByOctant(updates.keys);
+      auto octantMeasurement = [&updates, &bounds](unsigned int o) {
+        return [&updates, first = bounds[o]](size_t i) { return updates.measurement(first + i); };
+      };
+
+      // the children of the root are created (or the root expanded) as the updates would do it
+      std::array<Node*, 8> children{};
+      std::array<bool, 8> created{};
+      for (unsigned int o = 0; o < 8; ++o) {
+        size_t cnt = bounds[o + 1] - bounds[o];
+        if (cnt == 0) continue;
+        children[o] = this->rootNode->prepareChild(o, cnt, octantMeasurement(o), this->depth, this->context,
+                                                   created[o]);
+      }
+
+      std::span<const Key> keys = updates.keys;
+      std::span<const uint8_t> levels = updates.levels;
+      std::array<OcTreeStats, 8> childStats;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) default(none) \
+    shared(keys, levels, bounds, octantMeasurement, children, created, childStats)
+#endif
+      for (int o = 0; o < 8; ++o) {
+        Node* child = children[o];
+        if (child == nullptr) continue;
+        Context ctx = this->context;
+        ctx.stats.reset(this->depth);
+        auto childKeys = keys.subspan(bounds[o], bounds[o + 1] - bounds[o]);
+        auto childLevels = levels.empty() ? levels : levels.subspan(bounds[o], childKeys.size());
+        child->updateLogOddsBatch(childKeys, this->depth - 1, ctx, created[o], octantMeasurement(o), childLevels);
+        // only the updated paths need to be fixed
+        child->fixPaths(childKeys, this->depth - 1, ctx);
+        childStats[o] = std::move(ctx.stats);
+      }
+
+      for (const auto& stats: childStats) {
+        if (!stats.nodesPerDepth.empty()) this->context.stats.merge(stats);
+      }
+      this->rootNode->fixNode(this->context, this->depth);
+    }
+
+    /**
+     * Helper method that carves the free space of a batch of updates: the free updates that fill the whole volume
+     * of a coarser node (its 8 children, recursively) with the same log-odds value are merged into a single update
+     * of that node, which updates all its voxels at once (see OcNode::descend). The resulting map is the same: the
+     * voxels would be updated equally, and pruned back into the node.
+     * @param updates The updates to carve (distinct nodes, sorted in Morton order).
+     * @return The carved updates, in the same order.
+     */
+    [[nodiscard]] KeyUpdates carveFreeSpace(const KeyUpdates& updates) const {
+      // the descents of the updates start below the root (see updateParallel)
+      unsigned int maxLevel = this->depth >= 2 ? this->depth - 2 : 0;
+      KeyUpdates carved;
+      carved.sample = updates.sample;
+      carved.reserve(updates.keys.size());
+      carved.levels.reserve(updates.keys.size());
+      for (size_t i = 0; i < updates.keys.size(); ++i) {
+        auto [lo, sample] = updates.measurement(i);
+        carved.add(updates.keys[i], lo, sample != nullptr);
+        carved.levels.push_back(updates.levels.empty() ? 0 : updates.levels[i]);
+
+        // the nodes are distinct and contiguous (Morton order), so 8 nodes of the same level with the same parent
+        // are all its children
+        while (carved.keys.size() >= 8) {
+          size_t last = carved.keys.size() - 1, first = last - 7;
+          unsigned int level = carved.levels[last];
+          if (level >= maxLevel || !Node::sameParent(carved.keys[first], carved.keys[last], level + 1)) break;
+          bool fills = true;
+          for (size_t j = first; j <= last && fills; ++j) {
+            auto [childLo, childSample] = carved.measurement(j);
+            fills = carved.levels[j] == level && childLo < 0 && childLo == lo && childSample == nullptr;
+          }
+          if (!fills) break;
+
+          Key key = carved.keys[first];
+          carved.keys.resize(first);
+          carved.logOdds.resize(first);
+          if (carved.sample != nullptr) carved.hits.resize(first);
+          carved.levels.resize(first);
+          carved.add(key, lo, false);
+          carved.levels.push_back((uint8_t) (level + 1));
+        }
+      }
+      return carved;
+    }
+
+    /**
+     * Helper method that applies a batch of updates and fixes the Octomap. If the Octomap is empty, the tree is
+     * built bottom-up from the updated leaves instead (see buildParallel). Otherwise, the free space is carved
+     * first, if enabled (see carveFreeSpace).
+     * @param updates The updates to apply.
+     */
+    void applyUpdates(const KeyUpdates& updates) {
+      if (updates.keys.empty()) return;
+      this->version = Octomap::newVersion();
+
+      if (this->rootNode == nullptr) {
+        std::vector<Node> leaves;
+        leaves.reserve(updates.keys.size());
+        for (size_t i = 0; i < updates.keys.size(); ++i) {
+          auto [lo, sample] = updates.measurement(i);
+          Node& leaf = leaves.emplace_back();
+          leaf.updateLogOdds(lo);
+          if (sample != nullptr) leaf.getPayload().integrate(*sample);
+        }
+        this->buildParallel(updates.keys, leaves, updates.levels);
+        return;
+      }
+
+      // the volume of a node can't be updated at once if it skips levels
+      if (this->freeSpaceCarving && !this->context.hasSkips()) {
+        KeyUpdates carved = this->carveFreeSpace(updates);
+        this->applyBatch(carved);
+      } else {
+        this->applyBatch(updates);
+      }
+    }
+
+    /**
+     * Helper method that applies a batch of updates to the (existing) tree, and fixes the Octomap.
+     * @param updates The updates to apply.
+     */
+    void applyBatch(const KeyUpdates& updates) {
+      bool pendingFix = !this->dirtyKeys.empty() || this->fullFixPending;
+      if (this->depth >= 2 && !this->rootNode->skipsLevels() && !pendingFix) {
+        this->updateParallel(updates);
+      } else {
+        this->rootNode->updateLogOddsBatch(updates.keys, this->depth, this->context, false,
+                                           [&updates](size_t i) { return updates.measurement(i); }, updates.levels);
+        this->addDirtyKeys(updates.keys);
+        this->fix();
+      }
+    }
+
+    /**
+     * Helper method that merges free and occupied keys into a batch of updates (see bulkUpdate).
+     * @param freeKeys The keys of the free nodes/locations. They are sorted in place.
+     * @param occupiedKeys The keys of the occupied nodes/locations. They are sorted in place.
+     * @param occ The occupancy value to update the occupied nodes with.
+     * @param sample The payload of the measurements, integrated into the occupied nodes (nullptr for none).
+     * @param updates Replaced by the updates, with each key once (the occupied ones have priority), sorted in Morton
+     * order.
+     */
+    static void mergeUpdates(std::span<Key> freeKeys, std::span<Key> occupiedKeys, float occ, const Payload* sample,
+                             KeyUpdates& updates) {
+      MortonLess<Key> less;
+      Octomap::sortMorton(freeKeys);
+      Octomap::sortMorton(occupiedKeys);
+      float freeLo = (float) Node::prob2logodds(0), occLo = (float) Node::prob2logodds(occ);
+
+      // merge the (sorted) keys into a single batch
+      updates.clear();
+      updates.sample = sample;
+      updates.reserve(freeKeys.size() + occupiedKeys.size());
+      auto freeIt = freeKeys.begin(), occIt = occupiedKeys.begin();
+      while (freeIt != freeKeys.end() || occIt != occupiedKeys.end()) {
+        bool occupied = freeIt == freeKeys.end() || (occIt != occupiedKeys.end() && !less(*freeIt, *occIt));
+        const Key& key = occupied ? *occIt : *freeIt;
+        if (occupied && freeIt != freeKeys.end() && *freeIt == key) ++freeIt;
+        if (occupied) ++occIt;
+        else ++freeIt;
+        // repeated keys are only updated once
+        if (!updates.keys.empty() && updates.keys.back() == key) continue;
+        updates.add(key, occupied ? occLo : freeLo, occupied);
+      }
+    }
+
+    /**
+     * Helper method that checks if pointcloudUpdate inserts the measurements at coarser levels by range (see
+     * setInsertionLevels).
+     * @return True if the insertion levels are used. False, otherwise.
+     */
+    [[nodiscard]] bool usesInsertionLevels() const {
+      // the volume of a node can't be updated at once if it skips levels
+      return !this->insertionLevels.empty() && !this->context.hasSkips();
+    }
+
+    /**
+     * Helper method that calculates the insertion level of a location at the given range (see setInsertionLevels).
+     * Farther locations never have a finer level.
+     * @param range The distance between the location and the origin of the measurements.
+     * @return The insertion level (0 for the voxels).
+     */
+    [[nodiscard]] unsigned int rangeLevel(double range) const {
+      unsigned int level = 0;
+      for (const auto& [minRange, minRangeLevel]: this->insertionLevels) {
+        if (range < minRange) break;
+        level = std::max(level, minRangeLevel);
+      }
+      // the descents of the updates start below the root (see updateParallel)
+      return std::min(level, this->depth >= 2 ? this->depth - 2 : 0);
+    }
+
+    /**
+     * Helper method that calculates the key of the node at the given level that contains a voxel: the key of its
+     * first voxel (in Morton order).
+     * @param key The key of the voxel.
+     * @param level The level of the node (counting backwards, 0 is the voxel itself).
+     * @return The key of the node.
+     */
+    static Key cellKey(const Key& key, unsigned int level) {
+      return Key((T) (key.get(0) >> level << level), (T) (key.get(1) >> level << level),
+                 (T) (key.get(2) >> level << level));
+    }
+
+    /**
+     * Helper method that finds the node a voxel is inserted as (see setInsertionLevels): its coarsest ancestor
+     * whose center is at a range with (at least) its level. The choice only depends on that ancestor, so every
+     * voxel in it is inserted as the same node, and the nodes of a point cloud never overlap.
+     * @param key The key of the voxel.
+     * @param origin The origin of the measurements.
+     * @return The level of the node (see cellKey for its key).
+     */
+    [[nodiscard]] unsigned int insertionLevel(const Key& key, const Vector3<>& origin) const {
+      unsigned int maxLevel = this->rangeLevel(std::numeric_limits<double>::max());
+      if (maxLevel == 0) return 0;
+      // close to the origin, none of the ancestors can be coarser (their centers are within half a diagonal)
+      double range = (this->keyConverter.toCoord(key) - origin).norm();
+      if (this->rangeLevel(range + this->resolution * double(1u << maxLevel) * std::sqrt(3.0) / 2) == 0) return 0;
+
+      for (unsigned int level = maxLevel; level > 0; --level) {
+        auto offset = (float) (this->resolution * double((1u << level) - 1) / 2);
+        Vector3<> center = this->keyConverter.toCoord(Octomap::cellKey(key, level)) + Vector3<>(offset);
+        if (this->rangeLevel((center - origin).norm()) >= level) return level;
+      }
+      return 0;
+    }
+
+    /**
+     * Helper method that replaces the voxels of a ray by the nodes they are inserted as (see insertionLevel). The
+     * ray is monotonic on each axis, so the voxels of each node are contiguous, and each node is kept once.
+     * @param ray The keys of the voxels of the ray. Replaced by the keys of the nodes.
+     * @param origin The origin of the ray.
+     * @param levels Filled with the level of each node.
+     */
+    void toInsertionNodes(std::vector<Key>& ray, const Vector3<>& origin, std::vector<uint8_t>& levels) const {
+      size_t n = 0;
+      unsigned int level = 0;
+      for (size_t i = 0; i < ray.size(); ++i) {
+        Key voxel = ray[i];
+        if (n > 0 && level > 0 && Node::sameParent(ray[n - 1], voxel, level)) continue;
+        level = this->insertionLevel(voxel, origin);
+        ray[n++] = Octomap::cellKey(voxel, level);
+        levels.push_back((uint8_t) level);
+      }
+      ray.resize(n);
+    }
+
+    /**
+     * Helper method that removes the nodes of a ray whose free update wouldn't change the Octomap: the ones inside
+     * a leaf that is already stable free (see setStableFreeSkipping). The ray is monotonic on each axis, so the
+     * nodes inside each of those leaves are contiguous, and only the first one is searched for.
+     * @param ray The keys of the free nodes of the ray. The skipped ones are removed.
+     * @param levels The level of each node of the ray (see toInsertionNodes). Empty if they are all voxels.
+     * @param finger The finger of the searches of the current thread.
+     */
+    void removeStableFree(std::vector<Key>& ray, std::vector<uint8_t>& levels, Finger& finger) {
+      if (this->rootNode == nullptr) return;
+      Key leafKey;
+      unsigned int leafLevel = 0;
+      bool inLeaf = false;
+      size_t n = 0;
+      for (size_t i = 0; i < ray.size(); ++i) {
+        Key key = ray[i];
+        unsigned int level = levels.empty() ? 0 : levels[i];
+        // the node is inside the last stable free leaf if its first voxel is, and it isn't bigger
+        bool skip = inLeaf && level <= leafLevel && Node::sameParent(key, leafKey, leafLevel);
+        if (!skip) {
+          inLeaf = false;
+          this->resumeFinger(finger, key);
+          Node* node = this->rootNode->search(key, this->depth, finger.path);
+          if (node != nullptr && !node->hasChildren() && node->isFreeStable()) {
+            // the searches end at the last node of the path
+            leafLevel = finger.path.nodes[finger.path.len - 1].second;
+            leafKey = key;
+            inLeaf = true;
+            skip = level <= leafLevel;
+          }
+        }
+        if (skip) continue;
+        if (!levels.empty()) levels[n] = (uint8_t) level;
+        ray[n++] = key;
+      }
+      ray.resize(n);
+      if (!levels.empty()) levels.resize(n);
+    }
+
+    /**
+     * Helper method that calculates the nodes of a ray of a point cloud that are updated as free: the voxels the
+     * ray crosses (see rayCastBresenham), or the nodes they are inserted as (see setInsertionLevels), without the
+     * ones that are already stable free (see setStableFreeSkipping).
+     * @param origin The origin of the ray.
+     * @param endpoint The end of the ray.
+     * @param scratch The memory of the current thread.
+     * @return The keys of the free nodes of the ray (stored in the memory of the thread).
+     */
+    const std::vector<Key>& freeRayNodes(const Vector3<>& origin, const Vector3<>& endpoint, RayScratch& scratch) {
+      this->rayCastBresenham(origin, endpoint, scratch.ray);
+      scratch.levels.clear();
+      if (this->usesInsertionLevels()) this->toInsertionNodes(scratch.ray, origin, scratch.levels);
+      if (this->stableFreeSkipping) this->removeStableFree(scratch.ray, scratch.levels, scratch.finger);
+      return scratch.ray;
+    }
+
+    /**
+     * Helper method that calculates the node of a ray of a point cloud that is updated as occupied: the voxel of
+     * its end, or the node it is inserted as (see setInsertionLevels).
+     * @param origin The origin of the ray.
+     * @param endpoint The end of the ray.
+     * @return The key of the occupied node of the ray.
+     */
+    [[nodiscard]] Key hitNode(const Vector3<>& origin, const Vector3<>& endpoint) const {
+      Key end = this->keyConverter.toKey(endpoint);
+      if (this->usesInsertionLevels()) end = Octomap::cellKey(end, this->insertionLevel(end, origin));
+      return end;
+    }
+
+    /**
+     * Helper method that sets the level of the updates of a point cloud from their range (see setInsertionLevels).
+     * @param updates The updates, whose keys are the keys of the nodes they are inserted as.
+     * @param origin The origin of the measurements.
+     */
+    void assignInsertionLevels(KeyUpdates& updates, const Vector3<>& origin) const {
+      updates.levels.reserve(updates.keys.size());
+      for (const Key& key: updates.keys) updates.levels.push_back((uint8_t) this->insertionLevel(key, origin));
+    }
+
+    /**
+     * Helper method that merges the sorted Morton codes of free and occupied nodes into a batch of updates, in a
+     * single pass (the same as mergeUpdates).
+     * @param freeCodes The Morton codes of the free nodes, sorted.
+     * @param occupiedCodes The Morton codes of the occupied nodes, sorted.
+     * @param occ The occupancy value to update the occupied nodes with.
+     * @param sample The payload of the measurements, integrated into the occupied nodes (nullptr for none).
+     * @param updates Replaced by the updates, with each key once (the occupied ones have priority), sorted in Morton
+     * order.
+     */
+    static void mergeCodes(std::span<const uint64_t> freeCodes, std::span<const uint64_t> occupiedCodes, float occ,
+                           const Payload* sample, KeyUpdates& updates) {
+      float freeLo = (float) Node::prob2logodds(0), occLo = (float) Node::prob2logodds(occ);
+      updates.clear();
+      updates.sample = sample;
+      updates.reserve(freeCodes.size() + occupiedCodes.size());
+      size_t i = 0, j = 0;
+      uint64_t last = 0;
+      while (i < freeCodes.size() || j < occupiedCodes.size()) {
+        bool occupied = i == freeCodes.size() || (j < occupiedCodes.size() && occupiedCodes[j] <= freeCodes[i]);
+        uint64_t code = occupied ? occupiedCodes[j++] : freeCodes[i++];
+        // repeated codes are only updated once (the occupied ones come first)
+        if (!updates.keys.empty() && code == last) continue;
+        last = code;
+        updates.add(Key::fromMortonCode(code), occupied ? occLo : freeLo, occupied);
+      }
+    }
+
+    /**
+     * Helper method that joins a buffer of each thread into a single one, in parallel.
+     * @param threads The memory of the threads.
+     * @param partOf Gives the buffer of a thread.
+     * @param joined Replaced by the values of the buffers of all the threads, in order.
+     */
+    template<class PartOf>
+    static void joinCodes(const std::vector<RayScratch>& threads, PartOf partOf, std::vector<uint64_t>& joined) {
+      std::vector<size_t> offsets(threads.size() + 1, 0);
+      for (size_t i = 0; i < threads.size(); ++i) offsets[i + 1] = offsets[i] + partOf(threads[i]).size();
+      joined.resize(offsets.back());
+#ifdef _OPENMP
+#pragma omp parallel for default(none) shared(threads, partOf, offsets, joined)
+#endif
+      for (size_t i = 0; i < threads.size(); ++i) {
+        const std::vector<uint64_t>& values = partOf(threads[i]);
+        std::copy(values.begin(), values.end(), joined.begin() + (long) offsets[i]);
+      }
+    }
+
+    /**
+     * Helper method that implements pointcloudUpdate with PointcloudMode::SORTED: the Morton codes of the free
+     * and occupied nodes of the rays are written to flat buffers (one per thread), which are joined and radix
+     * sorted, and the nodes that are repeated (or both free and occupied) are resolved by a linear merge (see
+     * mergeCodes). Each thread skips the free nodes it wrote recently (see RECENT_CODES), which are most of the
+     * repeated ones, so there's less to sort.
+     * @param pointcloud A vector containing the end points of the rays to calculate (1 ray for each).
+     * @param origin The origin location of each raycast.
+     * @param occ The occupancy to update the end node (occupied) with.
+     * @param sample The payload of the measurement, integrated into the occupied nodes (nullptr for none).
+     */
+    void pointcloudSortedUpdate(const std::vector<Vector3f>& pointcloud, const Vector3f& origin, float occ,
+                                const Payload* sample) {
+      constexpr unsigned int CODE_BITS = 3 * Key::size;
+      PointcloudScratch& scratch = this->getScratch();
+      for (RayScratch& thread: scratch.threads) {
+        thread.freeCodes.clear();
+        thread.occupiedCodes.clear();
+        thread.occupiedCodes.reserve(pointcloud.size() / scratch.threads.size());
+        // the recent codes are tagged with the generation of the call (in the bits above the Morton code), so the
+        // ones of the previous calls don't match, and they're only reset when the generations run out
+        if (thread.recentCodes.empty() || ++thread.recentGeneration >= uint64_t(1) << (64 - CODE_BITS)) {
+          thread.recentCodes.assign(RECENT_CODES, 0);
+          thread.recentGeneration = 1;
+        }
+      }
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(auto) default(none) shared(pointcloud, origin, scratch)
+#endif
+      for (const auto& endpoint: pointcloud) {
+        int idx = 0;
+#ifdef _OPENMP
+        idx = omp_get_thread_num();
+#endif
+        RayScratch& thread = scratch.threads[idx];
+        for (const Key& key: this->freeRayNodes(origin, endpoint, thread)) {
+          // the nearby rays (usually the next ones of the thread) share most of their nodes near the origin
+          uint64_t code = key.mortonCode();
+          uint64_t tagged = code | (thread.recentGeneration << CODE_BITS);
+          uint64_t& slot = thread.recentCodes[key.hash() & (RECENT_CODES - 1)];
+          if (slot == tagged) continue;
+          slot = tagged;
+          thread.freeCodes.push_back(code);
+        }
+        thread.occupiedCodes.push_back(this->hitNode(origin, endpoint).mortonCode());
+      }
+
+      Octomap::joinCodes(scratch.threads, [](const RayScratch& thread) -> const auto& { return thread.freeCodes; },
+                         scratch.freeCodes);
+      Octomap::joinCodes(scratch.threads, [](const RayScratch& thread) -> const auto& { return thread.occupiedCodes; },
+                         scratch.occupiedCodes);
+      radixSort(scratch.freeCodes, scratch.sortBuffer, 3 * Key::size);
+      radixSort(scratch.occupiedCodes, scratch.sortBuffer, 3 * Key::size);
+
+      Octomap::mergeCodes(scratch.freeCodes, scratch.occupiedCodes, occ, sample, scratch.updates);
+      if (this->usesInsertionLevels()) this->assignInsertionLevels(scratch.updates, origin);
+      this->applyUpdates(scratch.updates);
+    }
+
+    /**
+     * Helper method that implements pointcloudUpdate with PointcloudMode::COUNT: the hits and misses of each
+     * voxel are counted in a hash map (one per thread), and each voxel is updated once with all of them.
+     * @param pointcloud A vector containing the end points of the rays to calculate (1 ray for each).
+     * @param origin The origin location of each raycast.
+     * @param occ The occupancy of a single hit.
+     * @param sample The payload of the measurement, integrated into the voxels with hits (nullptr for none).
+     */
+    void pointcloudCountUpdate(const std::vector<Vector3f>& pointcloud, const Vector3f& origin, float occ,
+                               const Payload* sample) {
+      PointcloudScratch& scratch = this->getScratch();
+      for (RayScratch& thread: scratch.threads) {
+        // the maps free their memory when cleared (if it's big), so it's reserved for as many nodes as last time
+        size_t lastSize = thread.counts.size();
+        thread.counts.clear();
+        thread.counts.reserve(lastSize);
+      }
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(auto) default(none) shared(pointcloud, origin, scratch)
+#endif
+      for (const auto& endpoint: pointcloud) {
+        int idx = 0;
+#ifdef _OPENMP
+        idx = omp_get_thread_num();
+#endif
+        RayScratch& thread = scratch.threads[idx];
+        for (const Key& key: this->freeRayNodes(origin, endpoint, thread)) ++thread.counts[key].misses;
+        ++thread.counts[this->hitNode(origin, endpoint)].hits;
+      }
+
+      // join the counts of the threads
+      RayCountMap& counts = scratch.threads[0].counts;
+      for (size_t i = 1; i < scratch.threads.size(); ++i) {
+        for (const auto& [key, count]: scratch.threads[i].counts) {
+          RayCount& total = counts[key];
+          total.hits += count.hits;
+          total.misses += count.misses;
+        }
+      }
+
+      std::vector<std::pair<Key, RayCount>>& entries = scratch.counts;
+      entries.assign(counts.begin(), counts.end());
+      Octomap::sortMorton(std::span(entries), [](const auto& entry) -> const Key& { return entry.first; });
+      float freeLo = (float) Node::prob2logodds(0), occLo = (float) Node::prob2logodds(occ);
+      KeyUpdates& updates = scratch.updates;
+      updates.clear();
+      updates.sample = sample;
+      updates.reserve(entries.size());
+      for (const auto& [key, count]: entries) {
+        if (count.hits > 0) updates.add(key, (float) count.hits * occLo, true);
+        else updates.add(key, (float) count.misses * freeLo, false);
+      }
+      if (this->usesInsertionLevels()) this->assignInsertionLevels(updates, origin);
+      this->applyUpdates(updates);
+    }
+
   public:
     /**
      * Instantiates an Octomap with the given maximum depth and resolution.
@@ -57,12 +962,11 @@ namespace octomap {
      * @param resolution The resolution to use.
      */
     Octomap(unsigned int maxDepth, double resolution) :
-        depth(maxDepth), resolution(resolution) {
+        depth(maxDepth), resolution(resolution), keyConverter(maxDepth, resolution), context(blocks) {
       assert(this->depth >= 1);
       assert(this->depth <= Key::size);
 
-      Key::setMaxCoord((int) pow(2, maxDepth - 1));
-      Key::setResolution(resolution);
+      this->context.stats.reset(this->depth);
 
       // pre-calculate step sizes
       this->stepLookupTable.reserve(this->depth + 2);
@@ -77,18 +981,82 @@ namespace octomap {
 
     Octomap() : Octomap(DFLT_RESOLUTION) {}
 
+    /**
+     * The children blocks are freed all at once by their pool (no need to traverse the tree).
+     */
     ~Octomap() {
       delete this->rootNode;
     }
 
     /**
-     * Calculates the number of nodes in the Octomap.
-     * Keep in mind that the number of nodes is calculated recursively each time this is called,
+     * Gets the number of nodes in the Octomap. The count is maintained incrementally, so this is O(1).
      * @return The number of nodes in the Octomap.
      */
     [[nodiscard]] unsigned int getSize() const {
-      if (this->rootNode == nullptr) return 0;
-      return this->rootNode->getChildCount() + 1;
+      return (unsigned int) this->context.stats.nodes;
+    }
+
+    /**
+     * Gets the statistics of the Octomap: number of nodes, leaves, occupied/free leaves, and nodes per depth.
+     * They are maintained incrementally by the operations of the Octomap, so this is O(1).
+     * @warning Changing the log-odds of nodes directly (e.g. through the pointers returned by search) is not
+     * accounted for.
+     * @return The statistics of the Octomap.
+     */
+    [[nodiscard]] const OcTreeStats& getStats() const {
+      return this->context.stats;
+    }
+
+    /**
+     * Gets the converter between locations and keys of this Octomap (it depends on its depth and resolution).
+     * @return The key converter of the Octomap.
+     */
+    [[nodiscard]] const OcNodeKeyConverter<T>& getKeyConverter() const {
+      return this->keyConverter;
+    }
+
+    /**
+     * Breakdown of the memory (in bytes) used by the nodes of an Octomap.
+     */
+    struct MemoryUsage {
+      /** The memory used by the stored nodes (the root and the nodes in the children blocks) */
+      size_t nodes = 0;
+      /** The memory of the children blocks taken by children that don't exist */
+      size_t emptyChildSlots = 0;
+      /** The memory of the pool not used by any children block (freed blocks waiting to be recycled) */
+      size_t poolSlack = 0;
+      /** The memory used by the stored nodes of each depth (counting backwards) */
+      std::vector<size_t> nodesPerDepth;
+      /** The memory kept by pointcloudUpdate for the next point clouds (freed by shrink) */
+      size_t scratch = 0;
+
+      [[nodiscard]] size_t total() const {
+        return this->nodes + this->emptyChildSlots + this->poolSlack + this->scratch;
+      }
+    };
+
+    /**
+     * Calculates the memory used by the Octomap. Computed from the statistics of the tree and of the node
+     * pool, and the capacity of the memory kept by pointcloudUpdate, so this is O(depth + threads).
+     * @warning Should not be called while the Octomap is being updated.
+     * @return The memory usage of the Octomap.
+     */
+    [[nodiscard]] MemoryUsage memoryUsage() const {
+      const OcTreeStats& stats = this->context.stats;
+      MemoryUsage usage;
+      usage.nodes = stats.getStoredNodes() * sizeof(Node);
+      usage.nodesPerDepth.resize(stats.nodesPerDepth.size());
+      for (size_t d = 0; d < stats.nodesPerDepth.size(); ++d) {
+        usage.nodesPerDepth[d] = (stats.nodesPerDepth[d] - stats.skippedPerDepth[d]) * sizeof(Node);
+      }
+
+      size_t blockBytes = this->blocks.getUsedBytes();
+      // the root isn't stored in a children block
+      size_t childBytes = this->rootNode ? usage.nodes - sizeof(Node) : 0;
+      usage.emptyChildSlots = blockBytes - childBytes;
+      usage.poolSlack = this->blocks.getAllocatedBytes() - blockBytes;
+      if (this->scratch != nullptr) usage.scratch = this->scratch->memoryUsage();
+      return usage;
     }
 
     /**
@@ -96,11 +1064,11 @@ namespace octomap {
      * @param key The key that represents the target node/location.
      * @param occ The value of occupancy to set.
      * @param lazy Whether or not to lazy eval (default=false).
+     * @param sample The payload of the measurement, integrated into the node (default=nullptr, none).
      * @return Pointer to the updated node.
      */
-    Node* setOccupancy(const Key& key, float occ, bool lazy = false) {
-      bool createdRoot = this->createRootIfNeeded();
-      return this->rootNode->setOccupancy(key, this->depth, occ, lazy, createdRoot);
+    Node* setOccupancy(const Key& key, float occ, bool lazy = false, const Payload* sample = nullptr) {
+      return this->setOrUpdateLogOdds(key, (float) Node::prob2logodds(occ), false, lazy, sample);
     }
 
     /**
@@ -108,10 +1076,11 @@ namespace octomap {
      * @param location The location of the node to set the value.
      * @param occ The value of occupancy to set.
      * @param lazy Whether or not to lazy eval (default=false).
+     * @param sample The payload of the measurement, integrated into the node (default=nullptr, none).
      * @return Pointer to the updated node.
      */
-    Node* setOccupancy(const Vector3<>& location, float occ, bool lazy = false) {
-      return this->setOccupancy(Key(location), occ, lazy);
+    Node* setOccupancy(const Vector3<>& location, float occ, bool lazy = false, const Payload* sample = nullptr) {
+      return this->setOccupancy(this->keyConverter.toKey(location), occ, lazy, sample);
     }
 
     /**
@@ -159,19 +1128,54 @@ namespace octomap {
      * @param key The key that represents the target node/location.
      * @param logOdds The value of log-odds to use in the update.
      * @param lazy Whether or not to lazy eval (default=false).
+     * @param sample The payload of the measurement, integrated into the node (default=nullptr, none).
      * @return Pointer to the updated node.
      */
-    Node* updateLogOdds(const Key& key, float logOdds, bool lazy = false) {
-      // We do a search before updating the target node. This small overhead can save a lot
-      // of time in the long-run. Note: the search takes O(l) time, where l is the max depth, which is constant.
-      // If the node already exists, we can see if the update would change its log-odds. If the node is stable
-      // (+/- 0 affected) or the log-odds is 0, the update wouldn't change anything, but we would still need to
-      // perform the intermediate node updates: the intermediate nodes wouldn't change, but the check would be performed.
-      auto s = this->search(key);
-      if (s && !s->wouldChange(logOdds)) return s;
+    Node* updateLogOdds(const Key& key, float logOdds, bool lazy = false, const Payload* sample = nullptr) {
+      // If the node already exists, the update can be skipped when it wouldn't change its log-odds: the node is
+      // stable (+/- 0 affected) or the log-odds is 0. Otherwise, we would still need to perform the intermediate
+      // node updates (they wouldn't change, but the checks would be performed). This is detected during the
+      // descent of the update, so it only traverses the tree once.
+      // A payload always changes the node, so it is never skipped.
+      return this->setOrUpdateLogOdds(key, logOdds, true, lazy, sample);
+    }
 
+    /**
+     * Updates the log-odds value of the nodes/locations represented by the given keys, in a single walk of the
+     * tree: the keys are sorted in Morton order, so each update resumes from the deepest node it shares
+     * with the previous one (instead of descending from the root). The updates are lazy, and the Octomap is
+     * fixed at the end (unless @param lazy is set).
+     * @param keys The keys that represent the target nodes/locations. They are sorted in place.
+     * @param logOdds The value of log-odds to use in the updates.
+     * @param lazy Whether or not to skip fixing the Octomap at the end (default=false).
+     * @param sample The payload of the measurements, integrated into the nodes (default=nullptr, none).
+     */
+    void updateBatch(std::span<Key> keys, float logOdds, bool lazy = false, const Payload* sample = nullptr) {
+      if (keys.empty()) return;
+      this->version = Octomap::newVersion();
+      Octomap::sortMorton(keys);
       bool createdRoot = this->createRootIfNeeded();
-      return this->rootNode->updateLogOdds(key, this->depth, logOdds, lazy, createdRoot);
+      this->rootNode->updateLogOddsBatch(keys, this->depth, logOdds, this->context, createdRoot, sample);
+      this->addDirtyKeys(keys);
+      if (!lazy) this->fix();
+    }
+
+    /**
+     * Updates the Octomap with a set of free and occupied nodes/locations: each of them is updated once (the
+     * occupied ones have priority over the free ones). If the Octomap is empty, the tree is built bottom-up,
+     * level by level, instead of inserting the keys one by one (much faster for a cold start, e.g. archived
+     * point clouds). Otherwise, the keys are applied in a single (batched) walk of the tree, like updateBatch.
+     * The result is the same, and the Octomap is fixed at the end.
+     * The subtrees of the children of the root are built/updated and fixed in parallel.
+     * @param freeKeys The keys of the free nodes/locations. They are sorted in place.
+     * @param occupiedKeys The keys of the occupied nodes/locations. They are sorted in place.
+     * @param occ The occupancy value to update the occupied nodes with.
+     * @param sample The payload of the measurements, integrated into the occupied nodes (default=nullptr, none).
+     */
+    void bulkUpdate(std::span<Key> freeKeys, std::span<Key> occupiedKeys, float occ, const Payload* sample = nullptr) {
+      KeyUpdates updates;
+      Octomap::mergeUpdates(freeKeys, occupiedKeys, occ, sample, updates);
+      this->applyUpdates(updates);
     }
 
     /**
@@ -179,10 +1183,11 @@ namespace octomap {
      * @param key The key that represents the target node/location.
      * @param occ The value of occupancy to use in the update.
      * @param lazy Whether or not to lazy eval (default=false).
+     * @param sample The payload of the measurement, integrated into the node (default=nullptr, none).
      * @return Pointer to the updated node.
      */
-    Node* updateOccupancy(const Key& key, float occ, bool lazy = false) {
-      return this->updateLogOdds(key, (float) Node::prob2logodds(occ), lazy);
+    Node* updateOccupancy(const Key& key, float occ, bool lazy = false, const Payload* sample = nullptr) {
+      return this->updateLogOdds(key, (float) Node::prob2logodds(occ), lazy, sample);
     }
 
     /**
@@ -190,19 +1195,177 @@ namespace octomap {
      * @param location The location of the node to update the value.
      * @param occ The value of occupancy to use in the update.
      * @param lazy Whether or not to lazy eval (default=false).
+     * @param sample The payload of the measurement, integrated into the node (default=nullptr, none).
      * @return Pointer to the updated node.
      */
-    Node* updateOccupancy(const Vector3<>& location, float occ, bool lazy = false) {
-      return this->updateOccupancy(Key(location), occ, lazy);
+    Node* updateOccupancy(const Vector3<>& location, float occ, bool lazy = false, const Payload* sample = nullptr) {
+      return this->updateOccupancy(this->keyConverter.toKey(location), occ, lazy, sample);
+    }
+
+    /**
+     * Sets how the Octomap decides if 8 sibling leaves can be pruned (collapsed into their parent).
+     * By default (PruneMode::EXACT), only siblings with strictly the same log-odds are pruned, which is lossless.
+     * The other modes are lossy: the siblings are replaced by their mean log-odds, but they prune many
+     * more nodes (e.g. free space with small differences caused by noise).
+     * @note The next fix is a full fix (see fix()), which prunes the whole tree with the new mode.
+     * @param mode The prune mode to use.
+     * @param tolerance The maximum log-odds difference between siblings (only used with PruneMode::TOLERANCE).
+     */
+    void setPruneMode(PruneMode mode, float tolerance = 0) {
+      this->context.pruneMode = mode;
+      this->context.pruneTolerance = tolerance;
+      this->fullFixPending = this->rootNode != nullptr;
+    }
+
+    [[nodiscard]] PruneMode getPruneMode() const {
+      return this->context.pruneMode;
+    }
+
+    /**
+     * Enables/disables path compression. When enabled, chains of nodes with a single child (common on sparse
+     * maps, e.g. sonar cones) are collapsed into a single node that skips those levels. These nodes are created
+     * when new branches are inserted and when the tree is fixed. This reduces the node count and the depth of
+     * the searches/updates.
+     * The output of writeBinary is the same (the skipped levels are written), and so is the size of the tree.
+     * Disabling it decompresses the whole tree, so the tree only has path compressed nodes while it's enabled
+     * (the updates that need every level stored, e.g. free space carving, rely on it).
+     * @note The iterators only visit the nodes that are actually stored (the skipped levels are not visited).
+     * @param enable Whether to use path compression.
+     */
+    void setPathCompression(bool enable) {
+      this->context.pathCompression = enable;
+      if (this->rootNode == nullptr) return;
+      if (enable) {
+        // the existing chains are only compressed by fixing the whole tree
+        this->fullFixPending = true;
+      } else if (this->context.stats.skippedNodes > 0) {
+        this->rootNode->decompressSubtree(this->context, this->depth);
+        this->version = Octomap::newVersion();
+      }
+    }
+
+    /**
+     * Sets how pointcloudUpdate integrates the rays of a point cloud (see PointcloudMode).
+     * @param mode The mode to use.
+     */
+    void setPointcloudMode(PointcloudMode mode) {
+      this->pointcloudMode = mode;
+    }
+
+    [[nodiscard]] PointcloudMode getPointcloudMode() const {
+      return this->pointcloudMode;
+    }
+
+    /**
+     * Enables/disables free space carving in pointcloudUpdate (and bulkUpdate): the free voxels that fill the whole
+     * volume of a coarser node (e.g. the space close to the sensor, crossed by many rays) are updated at the level
+     * of that node, with a single update, instead of one by one. The resulting map is the same.
+     * @note Not used with path compression. The empty Octomap is built bottom-up anyway (see bulkUpdate).
+     * @param enable Whether to carve the free space.
+     */
+    void setFreeSpaceCarving(bool enable) {
+      this->freeSpaceCarving = enable;
+    }
+
+    [[nodiscard]] bool getFreeSpaceCarving() const {
+      return this->freeSpaceCarving;
+    }
+
+    /**
+     * Sets the levels pointcloudUpdate inserts the measurements at, by their range: far measurements are inserted
+     * as coarser nodes (e.g. to match the positional uncertainty of far sonar returns), which creates fewer nodes
+     * and updates. Each entry (range, level) inserts the space at least that many meters away from the origin of
+     * the point cloud that many levels above the voxels (level 0). A voxel is inserted as its coarsest ancestor
+     * whose center is at a range with that level (so the nodes never overlap), and the whole node is updated
+     * (see OcNode::descend).
+     * @note Not used while the tree can have path compressed nodes (see setPathCompression). The levels are limited
+     * to the depth of the tree minus 2.
+     * @param levels The insertion levels by range. Empty (default) to insert every measurement as a voxel.
+     */
+    void setInsertionLevels(std::vector<std::pair<double, unsigned int>> levels) {
+      std::sort(levels.begin(), levels.end());
+      this->insertionLevels = std::move(levels);
+    }
+
+    [[nodiscard]] const std::vector<std::pair<double, unsigned int>>& getInsertionLevels() const {
+      return this->insertionLevels;
+    }
+
+    /**
+     * Enables/disables the skipping of stable free space in pointcloudUpdate: the free nodes of each ray that are
+     * inside a leaf that is already stable free (see OcNode::isFreeStable) are not updated, since their update
+     * wouldn't change them. Each run of those nodes costs a single search (a pruned leaf is jumped at once), instead
+     * of being stored, merged and updated node by node. The resulting map is the same.
+     * Useful for repeated scans from the same origin (e.g. a fixed sonar), where the near free space is stable.
+     * @param enable Whether to skip the stable free space.
+     */
+    void setStableFreeSkipping(bool enable) {
+      this->stableFreeSkipping = enable;
+    }
+
+    [[nodiscard]] bool getStableFreeSkipping() const {
+      return this->stableFreeSkipping;
     }
 
     /**
      * Fix the Octomap. This should be called after a set of lazy updates.
      * Updates the log-odds value of intermediate nodes and prunes the tree.
+     * Only the paths of the lazy updates since the last fix are visited (the rest of the tree is already
+     * fixed), so the cost depends on the size of the updates, not the size of the Octomap. The whole tree is
+     * visited after changing the prune mode or enabling path compression, or after more lazy updates than nodes.
+     * A full fix consolidates the whole tree (e.g. after a bulk import, or after changing the thresholds of OcNode),
+     * with the subtrees of the top levels fixed in parallel (see OcNode::fixTasks).
+     * @note The nodes edited directly (e.g. through the node returned by search) aren't recorded, so they are only
+     * fixed by a full fix.
+     * @param full Whether to fix the whole tree, instead of the paths of the lazy updates (default=false).
      */
-    void fix() {
-      if (!this->rootNode) return;
-      this->rootNode->fix();
+    void fix(bool full = false) {
+      if (full) this->fullFixPending = this->rootNode != nullptr;
+      this->version = Octomap::newVersion();
+      if (this->rootNode != nullptr) {
+        if (this->fullFixPending) {
+          // the top levels are fixed in parallel
+#ifdef _OPENMP
+#pragma omp parallel default(none)
+#pragma omp single
+#endif
+          this->rootNode->fixTasks(this->context, this->depth, std::min(this->depth, FIX_TASK_LEVELS));
+        } else {
+          Octomap::sortMorton(this->dirtyKeys);
+          this->rootNode->fixPaths(this->dirtyKeys, this->depth, this->context);
+        }
+      }
+      this->dirtyKeys.clear();
+      this->fullFixPending = false;
+    }
+
+    /**
+     * Compacts the Octomap: relocates all the nodes to a single contiguous buffer, in depth-first order
+     * (the same order used by the iterators and writeBinary). This improves the cache usage of the
+     * traversals of the tree, and should be called after a big batch of updates (e.g. the end of a mission).
+     * The Octomap can still be updated afterwards: new nodes are allocated as usual, and pruned nodes
+     * are recycled.
+     * The new buffer fits the nodes exactly, so this also gives the slack of the node pool back to the system.
+     * @warning Pointers to nodes obtained before compacting are invalidated (except the root).
+     */
+    void compact() {
+      if (this->rootNode == nullptr) return;
+      this->version = Octomap::newVersion();
+      MemoryPool<typename Node::ChildBlock> compacted;
+      compacted.reserve(this->blocks.getLiveCount());
+      this->rootNode->relocate(compacted);
+      // the old blocks are freed when compacted goes out of scope
+      this->blocks.swap(compacted);
+    }
+
+    /**
+     * Gives the memory that isn't used by nodes (see MemoryUsage::poolSlack) back to the system, and the memory
+     * kept by pointcloudUpdate for the next point clouds.
+     * Done by compacting the Octomap, so the same warnings apply (see compact()).
+     */
+    void shrink() {
+      this->compact();
+      this->scratch.reset();
     }
 
     /**
@@ -215,6 +1378,20 @@ namespace octomap {
       return this->rootNode->search(key, this->depth);
     }
 
+    /**
+     * Search for the node represented by @param key in the Octomap, starting at the given finger: a search for a key
+     * close to the one of the last search of the finger only visits the levels below the node they share.
+     * @note The finger is owned by the caller, so each thread needs its own (the searches are thread-safe).
+     * @param key The key that represents the target node/location.
+     * @param finger The finger of the last search of the caller (see Finger). It's moved to the new key.
+     * @return A pointer to the node represented by @param key.
+     */
+    Node* search(const Key& key, Finger& finger) {
+      if (this->rootNode == nullptr) return nullptr;
+      this->resumeFinger(finger, key);
+      return this->rootNode->search(key, this->depth, finger.path);
+    }
+
     /**
      * Search for the node represented by @param location in the Octomap.
      * @param location The location of the node to search
@@ -222,7 +1399,7 @@ namespace octomap {
      */
     Node* search(const Vector3<>& location) {
       if (this->rootNode == nullptr) return nullptr;
-      return this->search(Key(location));
+      return this->search(this->keyConverter.toKey(location));
     }
 
     /**
@@ -236,8 +1413,8 @@ namespace octomap {
     [[nodiscard]] std::vector<Key> rayCast(const Vector3<>& orig, const Vector3<>& end) const {
       std::vector<Key> ray;
 
-      auto coord = Key(orig);
-      auto endKey = Key(end);
+      auto coord = this->keyConverter.toKey(orig);
+      auto endKey = this->keyConverter.toKey(end);
       if (coord == endKey) return ray;
 
       // Initialization phase
@@ -247,8 +1424,8 @@ namespace octomap {
 
       auto direction = (end - orig);
       direction.normalize();
-      Vector3 origCoord = coord.toCoord();
-      double length = (endKey.toCoord() - origCoord).norm();
+      Vector3 origCoord = this->keyConverter.toCoord(coord);
+      double length = (this->keyConverter.toCoord(endKey) - origCoord).norm();
 
       for (int i = 0; i < 3; ++i) {
         if (direction[i] > 0) step[i] = 1;
@@ -271,7 +1448,7 @@ namespace octomap {
       while (coord != endKey &&
              (
                  *(min = std::min_element(tMax.begin(), tMax.end())) <= length ||
-                 (coord.toCoord() - origCoord).norm() <= length
+                 (this->keyConverter.toCoord(coord) - origCoord).norm() <= length
              )) {
         int idx = int(min - tMax.begin());
         // save key
@@ -293,10 +1470,23 @@ namespace octomap {
      */
     [[nodiscard]] std::vector<Key> rayCastBresenham(const Vector3<>& orig, const Vector3<>& end) const {
       std::vector<Key> ray;
+      this->rayCastBresenham(orig, end, ray);
+      return ray;
+    }
 
-      auto coord = Key(orig);
-      auto endKey = Key(end);
-      if (coord == endKey) return ray;
+    /**
+     * The same as the other rayCastBresenham, but the keys are stored in the given vector (e.g. to reuse its memory
+     * for many rays).
+     * @param orig The location to start the raycast from.
+     * @param end The end location of the raycast.
+     * @param ray Replaced by the keys of the nodes traveled by the raycasting algorithm.
+     */
+    void rayCastBresenham(const Vector3<>& orig, const Vector3<>& end, std::vector<Key>& ray) const {
+      ray.clear();
+
+      auto coord = this->keyConverter.toKey(orig);
+      auto endKey = this->keyConverter.toKey(end);
+      if (coord == endKey) return;
 
       auto d = Vector3<int>();
       auto d2 = Vector3<int>();
@@ -335,8 +1525,6 @@ namespace octomap {
         p1 += d2[idx1];
         p2 += d2[idx2];
       }
-
-      return ray;
     }
 
     /**
@@ -347,13 +1535,16 @@ namespace octomap {
      * @param end The end location of the raycast.
      * @param occ The occupancy value to use in the update of the end cell.
      * @param lazy Whether or not to use lazy eval (default=false).
+     * @param sample The payload of the measurement, integrated into the end cell (default=nullptr, none).
      */
-    void rayCastUpdate(const Vector3<>& orig, const Vector3<>& end, float occ, bool lazy = false) {
+    void rayCastUpdate(const Vector3<>& orig, const Vector3<>& end, float occ, bool lazy = false,
+                       const Payload* sample = nullptr) {
       auto ray = this->rayCast(orig, end);
+      auto freeLo = (float) Node::prob2logodds(0);
       for (auto& it: ray)
-        this->updateOccupancy(it, 0, lazy); // this->setEmpty(it, lazy);
-      this->updateOccupancy(end, occ, lazy);
-      if (lazy) this->rootNode->fix();
+        this->updateLogOdds(it, freeLo, lazy); // this->setEmpty(it, lazy);
+      this->updateOccupancy(end, occ, lazy, sample);
+      if (lazy) this->fix();
     }
 
     //TODO: Estimar quantos pontos vai ter cada thread para nao haver tantos resizes
@@ -366,69 +1557,77 @@ namespace octomap {
      * @param pointcloud A vector containing the end points of the rays to calculate (1 ray for each).
      * @param origin The origin location of each raycast.
      * @param occ The occupancy to update the end node (occupied) with.
+     * @param sample The payload of the measurement (e.g. the timestamp of the scan), integrated into the
+     * occupied nodes (default=nullptr, none).
      */
-    void pointcloudUpdate(const std::vector<Vector3f>& pointcloud, const Vector3f& origin, float occ) {
-      std::vector<KeySet> freeNodesList, occupiedNodesList;
-
-      // small hack to alloc 2 containers for each simultaneous thread
-#ifdef _OPENMP
-#pragma omp parallel default(none) shared(pointcloud, freeNodesList, occupiedNodesList)
-#pragma omp critical
-      {
-        if (omp_get_thread_num() == 0) {
-          int threadCnt = omp_get_num_threads();
-          freeNodesList.resize(threadCnt);
-          occupiedNodesList.resize(threadCnt);
-          for (int i = 0; i < threadCnt; ++i) {
-            freeNodesList.at(i).reserve((pointcloud.size() / threadCnt) * 50);
-            occupiedNodesList.at(i).reserve(pointcloud.size() / threadCnt);
-          }
+    void pointcloudUpdate(const std::vector<Vector3f>& pointcloud, const Vector3f& origin, float occ,
+                          const Payload* sample = nullptr) {
+      if (this->pointcloudMode == PointcloudMode::COUNT) {
+        this->pointcloudCountUpdate(pointcloud, origin, occ, sample);
+        return;
+      }
+      if constexpr (Key::size <= 21) {
+        if (this->pointcloudMode == PointcloudMode::SORTED) {
+          this->pointcloudSortedUpdate(pointcloud, origin, occ, sample);
+          return;
         }
       }
-#else
-      freeNodesList.resize(1);
-      occupiedNodesList.resize(1);
-      freeNodesList.at(0).reserve(pointcloud.size() * 50);
-      occupiedNodesList.at(0).reserve(pointcloud.size());
-#endif
+
+      // the sets keep their size from the previous point clouds (see PointcloudScratch)
+      PointcloudScratch& scratch = this->getScratch();
+      for (RayScratch& thread: scratch.threads) {
+        thread.freeNodes.clear();
+        thread.occupiedNodes.clear();
+        thread.occupiedNodes.reserve(pointcloud.size() / scratch.threads.size());
+      }
 
 #ifdef _OPENMP
-#pragma omp parallel for schedule(auto) default(none) shared(pointcloud, origin, freeNodesList, occupiedNodesList)
+#pragma omp parallel for schedule(auto) default(none) shared(pointcloud, origin, scratch)
 #endif
       for (const auto& endpoint: pointcloud) {
         int idx = 0;
 #ifdef _OPENMP
         idx = omp_get_thread_num();
 #endif
+        RayScratch& thread = scratch.threads[idx];
         // cast the ray
         //auto ray = this->rayCast(origin, endpoint);
-        auto ray = this->rayCastBresenham(origin, endpoint);
+        const auto& ray = this->freeRayNodes(origin, endpoint, thread);
         // store the ray info
-        freeNodesList.at(idx).insert(ray);
-        occupiedNodesList.at(idx).insert(Key(endpoint));
+        thread.freeNodes.insert(ray);
+        thread.occupiedNodes.insert(this->hitNode(origin, endpoint));
       }
 
       // join measurements
-      KeySet occupiedNodes(pointcloud.size());
-      for (auto& occupiedNodesI: occupiedNodesList) {
-        occupiedNodes.merge(occupiedNodesI);
+      KeySet& occupiedNodes = scratch.occupiedNodes;
+      occupiedNodes.clear();
+      occupiedNodes.reserve(pointcloud.size());
+      for (auto& thread: scratch.threads) {
+        occupiedNodes.merge(thread.occupiedNodes);
       }
-      KeySet freeNodes(pointcloud.size() * 50);
-      for (auto& freeNodesI: freeNodesList) {
-        freeNodes.merge(freeNodesI);
+      KeySet& freeNodes = scratch.freeNodes;
+      freeNodes.clear();
+      for (auto& thread: scratch.threads) {
+        freeNodes.merge(thread.freeNodes);
       }
 
       // update nodes, discarding updates on freenodes that will be set as occupied
+      // the updates are batched (sorted), so they walk the tree once (or build it, if it's empty)
+      std::vector<Key>& freeKeys = scratch.freeKeys;
+      std::vector<Key>& occupiedKeys = scratch.occupiedKeys;
+      freeKeys.clear();
       for (const auto& freeNode: freeNodes) {
         if (!occupiedNodes.contains(freeNode->getValue()))
-          this->updateOccupancy(freeNode->getValue(), 0, true);
+          freeKeys.push_back(freeNode->getValue());
       }
-
+      occupiedKeys.clear();
       for (const auto& occupiedNode: occupiedNodes) {
-        this->updateOccupancy(occupiedNode->getValue(), occ, true);
+        occupiedKeys.push_back(occupiedNode->getValue());
       }
 
-      this->rootNode->fix();
+      Octomap::mergeUpdates(freeKeys, occupiedKeys, occ, sample, scratch.updates);
+      if (this->usesInsertionLevels()) this->assignInsertionLevels(scratch.updates, origin);
+      this->applyUpdates(scratch.updates);
     }
 
     /**
@@ -440,18 +1639,23 @@ namespace octomap {
      * @param pointcloud A vector containing the end points of the rays to calculate (1 ray for each).
      * @param origin The origin location of each raycast.
      * @param occ The occupancy value to update the end node with.
+     * @param sample The payload of the measurement, integrated into the occupied nodes (default=nullptr, none).
      */
-    void discretizedPointcloudUpdate(const std::vector<Vector3f>& pointcloud, const Vector3f& origin, float occ) {
-      std::vector<Vector3f> discretizedPc;
-      KeySet endpoints;
+    void discretizedPointcloudUpdate(const std::vector<Vector3f>& pointcloud, const Vector3f& origin, float occ,
+                                     const Payload* sample = nullptr) {
+      PointcloudScratch& scratch = this->getScratch();
+      KeySet& endpoints = scratch.endpoints;
+      std::vector<Vector3f>& discretizedPc = scratch.discretizedPc;
+      endpoints.clear();
+      discretizedPc.clear();
       for (const auto& endpointCoord: pointcloud) {
-        Key endpoint = Key(endpointCoord);
+        Key endpoint = this->keyConverter.toKey(endpointCoord);
         if (endpoints.insert(std::move(endpoint))) {
           discretizedPc.push_back(endpointCoord);
         }
       }
 
-      this->pointcloudUpdate(discretizedPc, origin, occ);
+      this->pointcloudUpdate(discretizedPc, origin, occ, sample);
     }
 
     /**
@@ -0,0 +1,90 @@
+#ifndef SLAM_RADIXSORT_H
+#define SLAM_RADIXSORT_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#ifdef _OPENMP
+
+#include <omp.h>
+
+#endif
+
+/** The number of bits sorted by each pass of radixSort */
+#define RADIX_BITS 8u
+/** The minimum number of values sorted by radixSort in parallel */
+#define RADIX_PARALLEL_MIN 65536u
+
+namespace octomap {
+  /**
+   * Sorts unsigned integers (e.g. Morton codes, see OcNodeKey::mortonCode) with a parallel LSD radix sort.
+   * Each pass sorts the values by RADIX_BITS of them: each thread counts the digits of its chunk of the values,
+   * and then scatters them to their place (after the ones of the same digit of the previous threads, so the sort
+   * is stable). The passes where every value has the same digit (e.g. the high bits of nearby keys) are skipped.
+   * @param values The values to sort.
+   * @param buffer The scratch memory of the sort (resized to the size of the values). Can be reused by the caller
+   * to avoid allocations.
+   * @param bits The number of (low) bits of the values that are sorted (the rest are ignored).
+   */
+  inline void radixSort(std::vector<uint64_t>& values, std::vector<uint64_t>& buffer, unsigned int bits) {
+    constexpr size_t BUCKETS = 1u << RADIX_BITS;
+    size_t n = values.size();
+    buffer.resize(n);
+#ifdef _OPENMP
+    std::vector<std::array<size_t, BUCKETS>> countsList(n >= RADIX_PARALLEL_MIN ? omp_get_max_threads() : 1);
+#else
+    std::vector<std::array<size_t, BUCKETS>> countsList(1);
+#endif
+
+    for (unsigned int shift = 0; shift < bits; shift += RADIX_BITS) {
+      bool sorted = false;
+#ifdef _OPENMP
+#pragma omp parallel num_threads(countsList.size()) default(none) shared(values, buffer, countsList, n, shift, sorted)
+#endif
+      {
+        size_t idx = 0, threadCnt = 1;
+#ifdef _OPENMP
+        idx = omp_get_thread_num();
+        threadCnt = omp_get_num_threads();
+#endif
+        size_t begin = n * idx / threadCnt, end = n * (idx + 1) / threadCnt;
+        std::array<size_t, BUCKETS>& counts = countsList[idx];
+        const uint64_t* src = values.data();
+        uint64_t* dst = buffer.data();
+        counts.fill(0);
+        for (size_t i = begin; i < end; ++i) ++counts[(src[i] >> shift) & (BUCKETS - 1)];
+
+#ifdef _OPENMP
+#pragma omp barrier
+#pragma omp single
+#endif
+        {
+          // the counts become the offset of each (digit, thread) in the output
+          size_t offset = 0;
+          for (size_t digit = 0; digit < BUCKETS; ++digit) {
+            size_t digitCnt = 0;
+            for (size_t t = 0; t < threadCnt; ++t) {
+              size_t count = countsList[t][digit];
+              countsList[t][digit] = offset;
+              offset += count;
+              digitCnt += count;
+            }
+            if (digitCnt == n) sorted = true;
+          }
+        }
+
+        if (!sorted) {
+          for (size_t i = begin; i < end; ++i) {
+            uint64_t value = src[i];
+            dst[counts[(value >> shift) & (BUCKETS - 1)]++] = value;
+          }
+        }
+      }
+      if (!sorted) values.swap(buffer);
+    }
+  }
+}
+
+#endif //SLAM_RADIXSORT_H
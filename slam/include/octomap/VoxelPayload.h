@@ -0,0 +1,115 @@
+#ifndef SLAM_VOXELPAYLOAD_H
+#define SLAM_VOXELPAYLOAD_H
+
+#include <algorithm>
+#include <cstdint>
+
+namespace octomap {
+  /**
+   * The data stored in each node besides its occupancy (log-odds). The payload is a policy of the nodes
+   * (see OcNode), and it has to define:
+   *  - integrate(sample): merges a measurement (the payload given to an update) into a leaf;
+   *  - canPrune(sibling): whether 8 sibling leaves with these payloads can be collapsed into their parent
+   *    (checked on top of the occupancy criteria of the prune mode);
+   *  - aggregate(child, first): accumulates the payload of a child into its parent (when the parent is
+   *    updated from its children, or prunes them). @param first is true for the first child.
+   *
+   * The default payload is empty: the nodes only store their occupancy, so they have the same layout
+   * (and cost) as nodes without payload.
+   */
+  struct OccupancyPayload {
+    void integrate(const OccupancyPayload&) {}
+
+    [[nodiscard]] bool canPrune(const OccupancyPayload&) const {
+      return true;
+    }
+
+    void aggregate(const OccupancyPayload&, bool) {}
+  };
+
+  /**
+   * The intensity of the last measurement of the voxel (e.g. the sonar return strength).
+   * Inner nodes hold the maximum intensity of their children, and only siblings with the same
+   * intensity are pruned.
+   */
+  struct IntensityPayload {
+    float intensity = 0;
+
+    void integrate(const IntensityPayload& sample) {
+      this->intensity = sample.intensity;
+    }
+
+    [[nodiscard]] bool canPrune(const IntensityPayload& sibling) const {
+      return this->intensity == sibling.intensity;
+    }
+
+    void aggregate(const IntensityPayload& child, bool first) {
+      this->intensity = first ? child.intensity : std::max(this->intensity, child.intensity);
+    }
+  };
+
+  /**
+   * The time of the last update of the voxel (in the units of the user, e.g. seconds or scan number).
+   * Inner nodes hold the most recent timestamp of their children. Timestamps don't prevent pruning:
+   * the pruned node keeps the most recent one.
+   */
+  struct TimestampPayload {
+    uint32_t timestamp = 0;
+
+    void integrate(const TimestampPayload& sample) {
+      this->timestamp = std::max(this->timestamp, sample.timestamp);
+    }
+
+    [[nodiscard]] bool canPrune(const TimestampPayload&) const {
+      return true;
+    }
+
+    void aggregate(const TimestampPayload& child, bool first) {
+      this->timestamp = first ? child.timestamp : std::max(this->timestamp, child.timestamp);
+    }
+  };
+
+  /**
+   * The number of updates of the voxel that integrated a sample, not the number of rays: a point cloud
+   * updates each voxel at most once, however many of its rays end in it (even with PointcloudMode::COUNT).
+   * Inner nodes hold the maximum count of their children, and only siblings with the same count are pruned
+   * (so expanding a pruned node is lossless).
+   */
+  struct CountPayload {
+    uint32_t count = 0;
+
+    void integrate(const CountPayload&) {
+      ++this->count;
+    }
+
+    [[nodiscard]] bool canPrune(const CountPayload& sibling) const {
+      return this->count == sibling.count;
+    }
+
+    void aggregate(const CountPayload& child, bool first) {
+      this->count = first ? child.count : std::max(this->count, child.count);
+    }
+  };
+
+  /**
+   * Combines several payloads into one (e.g. CombinedPayload<IntensityPayload, CountPayload>).
+   * Each part behaves as it would on its own, and siblings are only pruned if all parts allow it.
+   * @tparam Ps The payloads to combine.
+   */
+  template<class... Ps>
+  struct CombinedPayload : Ps ... {
+    void integrate(const CombinedPayload& sample) {
+      (Ps::integrate(sample), ...);
+    }
+
+    [[nodiscard]] bool canPrune(const CombinedPayload& sibling) const {
+      return (Ps::canPrune(sibling) && ...);
+    }
+
+    void aggregate(const CombinedPayload& child, bool first) {
+      (Ps::aggregate(child, first), ...);
+    }
+  };
+}
+
+#endif //SLAM_VOXELPAYLOAD_H